@@ -33,5 +33,8 @@ static unsigned int lineheight = 0;       /* -h option */
 static const char worddelimiters[] = " "; /* hard coded */
 static unsigned int border_width = 0;     /* -bw option */
 static int use_prefix = 0;                /* -x option */
+static int fuzzy = 0;                     /* -z option; fuzzy matching ranked by score */
+static int stream_interval = 100;         /* -s option; ms between redraws while reading stdin */
+static size_t index_min = 100000;         /* index trigrams of at least this many items; 0 never */
 
 #endif  // CONFIG_H
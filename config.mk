@@ -21,8 +21,8 @@ LIBS     = $(XINERAMALIBS) `pkg-config $(REQ_LIBS) --libs`
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\"
-CFLAGS   = -std=c99 -pedantic -Wall -Os $(LIBFLAGS) $(CPPFLAGS)
-LDFLAGS  = $(LIBS)
+CFLAGS   = -std=c99 -pedantic -Wall -Os -pthread $(LIBFLAGS) $(CPPFLAGS)
+LDFLAGS  = -pthread $(LIBS) -lm
 
 # compiler and linker
 CC ?= gcc
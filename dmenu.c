@@ -4,18 +4,30 @@
 
 #include "config.h"
 #include "drw.h"
+#include "fuzzy.h"
+#include "history.h"
+#include "pool.h"
+#include "search.h"
+#include "server.h"
+#include "trigram.h"
 #include "util.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
-#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <X11/extensions/render.h>
 #include <X11/extensions/Xrender.h>
@@ -39,11 +51,79 @@
 #define OPACITY          "_NET_WM_WINDOW_OPACITY"
 #define NUMBERSMAXDIGITS 100
 #define NUMBERSBUFSIZE   (NUMBERSMAXDIGITS * 2) + 1
+#define CHUNKSIZE        (1 << 20) /* initial size of a stdin read block */
+#define WIDTHSAMPLE      16        /* items measured to estimate the widest one */
+#define SHARDMIN         8192      /* fewest items matched by one worker at once */
+#define MAXSHARDS        256
+#define FUZZYTOPK        1024      /* fuzzy matches sorted by score, the rest keep input order */
+#define HLCACHE          256       /* items whose highlights are kept, at least a page */
+#define FOLDCHUNK        4096      /* items whose texts are case-folded together, a power of two */
+
+enum { MatchExact, MatchPrefix, MatchSubstr, MatchNone }; /* match classes */
+
+/* the current input split into tokens */
+struct query {
+    char *text; /* text, case-folded with -i */
+    char **tokv;
+    size_t *toklen;
+    int tokc;
+    size_t len;      /* length of the first token */
+    size_t maxlen;   /* length of the longest token */
+    size_t textlen;  /* length of text */
+};
+
+/* a highlighted part of an item text */
+struct span {
+    size_t off, len;
+};
+
+/* the spans of an item matching the tokens of a match */
+struct highlights {
+    size_t item;
+    unsigned long gen; /* matchgen they were computed for, 0 if unused */
+    struct span *spans;
+    size_t n, size;
+};
+
+/* filter candidates in shards on the worker pool */
+struct filterjob {
+    const unsigned int *src;
+    size_t from, n, nshards;
+    unsigned int *out;
+    size_t *count;
+    struct query *q;
+};
+
+/* find the match class of each candidate in shards on the worker pool */
+struct classifyjob {
+    const unsigned int *idx;
+    size_t n, nshards;
+    unsigned char *class;
+    struct query *q;
+};
+
+/* score candidates for fuzzy matching in shards on the worker pool */
+struct scorejob {
+    const unsigned int *idx;
+    size_t n, nshards;
+    int *score;
+    struct query *q;
+};
 
-struct item {
+/* a fuzzy match candidate: its score and its position among the candidates */
+struct scored {
+    int score;
+    float rank; /* history score of the item */
+    unsigned int i;
+};
+
+/* one level of the incremental match stack: the query it was computed for and
+ * the indices (in input order) of all items matching every token of it */
+struct matchlevel {
     char *text;
-    struct item *left, *right;
-    int out;
+    unsigned int *idx;
+    size_t n, scanned;
+    size_t maxlen; /* length of the longest token */
 };
 
 static const unsigned int baralpha = 0xFF;
@@ -64,12 +144,60 @@ static char text[BUFSIZ] = "";
 static char *embed;
 static int bh, mw, mh;
 static int inputw = 0, promptw;
+static int larroww, rarroww, numbersw; /* TEXTW of "<", ">" and numbers */
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
 static char **argv_items = NULL;
-static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static char *infile = NULL; /* read instead of stdin */
+static char *histfile = NULL;
+static History *history = NULL; /* selections, to rank the items selected before first */
+static float *ranks = NULL;     /* history score of each item, with history */
+/* the items, as a structure of arrays: their texts are stored one after
+ * another in a string pool, which may be a read-only mapping of the input, so
+ * they are only known by offset and length and need not be NUL-terminated */
+static char *pool = NULL;
+/* with -i, the texts of each FOLDCHUNK items case-folded one after another, or
+ * NULL as long as folding leaves them as they are in the pool */
+static char **folds = NULL;
+static size_t poollen, poolsize, foldsize;
+static size_t readstart; /* offset of the line being read */
+static int poolmapped;   /* pool is a mapping of stdin */
+static size_t *offs = NULL;         /* offset of each text in pool */
+static unsigned int *lens = NULL;   /* length of each text */
+static unsigned int *widths = NULL; /* TEXTW of each text, 0 until it is first needed */
+static unsigned char *outs = NULL;  /* bitset of the items printed with Ctrl-Return */
+static size_t nitems, nread, itemsize; /* items shown; read, as streaming shows them later */
+static int streaming = 0, spinner = 0;
+static int icase = 0;
+static int syncx = 0; /* make every X request synchronous, for debugging */
+static int fast = 0;    /* grab the keyboard before reading stdin */
+static int client = 0;  /* run the menu in a daemon, if one is listening */
+static int serving = 0; /* run the menus of clients as a daemon */
+static jmp_buf menuend; /* where a menu of the daemon ends */
+static Fnt *daemonfonts;              /* while a menu uses other fonts */
+static Clr *daemonscheme[SchemeLast]; /* while a menu uses other colors */
+static int (*xerrorxlib)(Display *, XErrorEvent *);
+static size_t widest; /* index of the widest item, used for inputw */
+static int dirty;     /* the matches changed since the menu was last drawn */
+static int rematch;   /* the text changed since the last match */
+/* what the window shows, so that only what changed is redrawn */
+static size_t shownsel, showncurr;
+static size_t showncursor;
+static char showntext[sizeof text];
+static unsigned int *matches; /* indices of the matching items, in order */
+static size_t nmatches, matchsize;
+static size_t prev, curr, next, sel; /* positions in matches; next is nmatches on the last page */
+static struct matchlevel *levels;
+static struct query query;     /* tokens of the last match, also highlighted */
+static unsigned long matchgen; /* number of matches so far */
+static struct highlights hlcache[HLCACHE];
+static size_t nlevels, levelsize;
+static Trigram *tindex; /* NULL until built in the background */
+static size_t tindexn;  /* number of items in tindex */
+static pthread_mutex_t tindexlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t indexthread;
+static int indexing;  /* indexthread is running or done, and not joined */
+static int stopindex; /* tell indexthread to give up, under tindexlock */
 static int mon = -1, screen;
 
 static Atom clip, utf8;
@@ -85,41 +213,129 @@ static Colormap cmap;
 static Drw *drw;
 static Clr *scheme[SchemeLast];
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static char *(*fstrstr)(const char *, size_t, const char *, size_t) = search_find;
 
-static void appenditem(struct item *item, struct item **list, struct item **last) {
-    if (*last)
-        (*last)->right = item;
-    else
-        *list = item;
+#define OPTION(X) {&(X), sizeof(X), NULL}
+
+/* the options, which the daemon resets to its own for each menu */
+static struct {
+    void *var;
+    size_t size;
+    void *saved;
+} options[] = {
+    OPTION(topbar), OPTION(centered), OPTION(fast), OPTION(streaming), OPTION(icase), OPTION(use_prefix),
+    OPTION(fuzzy), OPTION(lines), OPTION(columns), OPTION(lineheight), OPTION(border_width), OPTION(mon),
+    OPTION(alphas), OPTION(colors), OPTION(fonts), OPTION(prompt), OPTION(embed), OPTION(argv_items),
+    OPTION(histfile),
+};
 
-    item->left = *last;
-    item->right = NULL;
-    *last = item;
+static void saveoptions(void) {
+    size_t i;
+
+    for (i = 0; i < LENGTH(options); i++) {
+        options[i].saved = ecalloc(1, options[i].size);
+        memcpy(options[i].saved, options[i].var, options[i].size);
+    }
+}
+
+static void restoreoptions(void) {
+    size_t i;
+
+    for (i = 0; i < LENGTH(options); i++)
+        memcpy(options[i].var, options[i].saved, options[i].size);
+}
+
+/* whether the option stored at var differs from the saved one */
+static int optionchanged(const void *var) {
+    size_t i;
+
+    for (i = 0; options[i].var != var; i++)
+        ;
+    return memcmp(options[i].var, options[i].saved, options[i].size) != 0;
+}
+
+static const char *itemtext(size_t i) {
+    return pool + offs[i];
+}
+
+/* the text of item i as matched: case-folded with -i */
+static const char *itemfold(size_t i) {
+    const char *f = icase ? folds[i / FOLDCHUNK] : NULL;
+
+    return f ? f + offs[i] - offs[i & ~(size_t)(FOLDCHUNK - 1)] : pool + offs[i];
+}
+
+static float itemrank(size_t i) {
+    return history ? ranks[i] : 0;
+}
+
+static int itemout(size_t i) {
+    return outs[i / 8] >> (i % 8) & 1;
+}
+
+static unsigned int itemw(size_t i) {
+    if (!widths[i])
+        widths[i] = drw_fontset_getwidthn(drw, itemtext(i), lens[i]) + lrpad;
+    return widths[i];
 }
 
 static void calcoffsets(void) {
     int i, n;
 
-    if (lines > 0)
-        n = lines * columns * bh;
-    else
-        n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
     /* calculate which items will begin the next page and previous page */
-    for (i = 0, next = curr; next; next = next->right)
-        if ((i += (lines > 0) ? bh : MIN(TEXTW(next->text), n)) > n)
+    if (lines > 0) {
+        next = MIN(nmatches, curr + lines * columns);
+        prev = curr - MIN(curr, lines * columns);
+        return;
+    }
+    n = mw - (promptw + inputw + larroww + rarroww);
+    for (i = 0, next = curr; next < nmatches; next++)
+        if ((i += MIN(itemw(matches[next]), n)) > n)
             break;
-    for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-        if ((i += (lines > 0) ? bh : MIN(TEXTW(prev->left->text), n)) > n)
+    for (i = 0, prev = curr; prev > 0; prev--)
+        if ((i += MIN(itemw(matches[prev - 1]), n)) > n)
             break;
 }
 
+static size_t utf8charlen(char c) {
+    return (c & 0xf0) == 0xf0 ? 4 : (c & 0xe0) == 0xe0 ? 3 : (c & 0xc0) == 0xc0 ? 2 : 1;
+}
+
+static unsigned int utf8len(const char *s, size_t len) {
+    unsigned int n = 0;
+
+    for (; len--; s++)
+        n += (*s & 0xc0) != 0x80;
+    return n;
+}
+
+/* estimate which of widest and the items from..to-1 is the widest by measuring only
+ * the WIDTHSAMPLE items with the most codepoints, instead of every item */
+static size_t estimatewidest(size_t from, size_t to, size_t widest) {
+    size_t idx[WIDTHSAMPLE], i, n = 0;
+    unsigned int len[WIDTHSAMPLE], l;
+    int j;
+
+    for (i = from; i < to; i++) {
+        l = utf8len(itemtext(i), lens[i]);
+        if (n == WIDTHSAMPLE && l <= len[n - 1])
+            continue;
+        /* keep the sample sorted by length, dropping the shortest */
+        for (j = n < WIDTHSAMPLE ? n++ : n - 1; j > 0 && len[j - 1] < l; j--) {
+            len[j] = len[j - 1];
+            idx[j] = idx[j - 1];
+        }
+        len[j] = l;
+        idx[j] = i;
+    }
+    for (i = 0; i < n; i++)
+        if (widest >= to || itemw(idx[i]) > itemw(widest))
+            widest = idx[i];
+    return widest;
+}
+
 static int max_textw(void) {
-    int len = 0;
-    for (struct item *item = items; item && item->text; item++)
-        len = MAX(TEXTW(item->text), len);
-    return len;
+    return nitems ? itemw(widest) : 0;
 }
 
 static void cleanup(void) {
@@ -129,89 +345,129 @@ static void cleanup(void) {
     for (i = 0; i < SchemeLast; i++)
         free(scheme[i]);
     drw_free(drw);
+    history_free(history);
     XSync(dpy, False);
     XCloseDisplay(dpy);
 }
 
-static char *cistrstr(const char *s, const char *sub) {
-    size_t len;
+static int cmpspan(const void *a, const void *b) {
+    size_t oa = ((const struct span *)a)->off, ob = ((const struct span *)b)->off;
+
+    return (oa > ob) - (oa < ob);
+}
+
+static void addspan(struct highlights *h, size_t off, size_t len) {
+    if (h->n == h->size && !(h->spans = realloc(h->spans, (h->size = MAX(16, h->size * 2)) * sizeof *h->spans)))
+        die("cannot realloc %u bytes:", h->size * sizeof *h->spans);
+    h->spans[h->n++] = (struct span){.off = off, .len = len};
+}
 
-    for (len = strlen(sub); *s; s++)
-        if (!strncasecmp(s, sub, len))
-            return (char *)s;
-    return NULL;
-}
-
-static void drawhighlights(struct item *item, int x, int y, int maxw) {
-    char restorechar, tokens[sizeof text], *highlight, *token;
-    int indentx, highlightlen;
-
-    drw_setscheme(drw, scheme[item == sel ? SchemeSelHighlight : SchemeNormHighlight]);
-    strcpy(tokens, text);
-    for (token = strtok(tokens, " "); token; token = strtok(NULL, " ")) {
-        highlight = fstrstr(item->text, token);
-        while (highlight) {
-            // Move item str end, calc width for highlight indent, & restore
-            highlightlen = highlight - item->text;
-            restorechar = *highlight;
-            item->text[highlightlen] = '\0';
-            indentx = TEXTW(item->text);
-            item->text[highlightlen] = restorechar;
-
-            // Move highlight str end, draw highlight, & restore
-            restorechar = highlight[strlen(token)];
-            highlight[strlen(token)] = '\0';
-            if (indentx - (lrpad / 2) - 1 < maxw)
-                drw_text(drw, x + indentx - (lrpad / 2) - 1, y, MIN(maxw - indentx, TEXTW(highlight) - lrpad), bh, 0, highlight, 0);
-            highlight[strlen(token)] = restorechar;
-
-            if (strlen(highlight) - strlen(token) < strlen(token))
+/* return the spans of item matching the tokens of the last match, sorted by
+ * offset; they are only computed once per match for each item drawn */
+static struct highlights *itemspans(size_t item) {
+    static size_t pos[sizeof text];
+    struct highlights *h = &hlcache[item % HLCACHE];
+    const char *hit, *token, *itext = itemtext(item), *ifold = itemfold(item);
+    size_t ilen = lens[item];
+    size_t toklen, end;
+    int i, j, n, t, score;
+
+    if (h->item == item && h->gen == matchgen)
+        return h;
+    h->item = item;
+    h->gen = matchgen;
+    h->n = 0;
+    for (t = 0; t < query.tokc; t++) {
+        token = query.tokv[t];
+        toklen = query.toklen[t];
+        if (fuzzy) {
+            /* highlight the matched characters, joining adjacent ones */
+            n = fuzzy_match(itext, ifold, ilen, token, toklen, &score, pos);
+            for (i = 0; i < n; i = j) {
+                end = pos[i] + utf8charlen(itext[pos[i]]);
+                for (j = i + 1; j < n && pos[j] == end; j++)
+                    end += utf8charlen(itext[pos[j]]);
+                addspan(h, pos[i], MIN(end, ilen) - pos[i]);
+            }
+            continue;
+        }
+        /* offsets in the folded copy are the same as in text */
+        for (hit = fstrstr(ifold, ilen, token, toklen); hit;) {
+            addspan(h, hit - ifold, toklen);
+            if (ilen - (hit - ifold) - toklen < toklen)
                 break;
-            highlight = fstrstr(highlight + strlen(token), token);
+            hit += toklen;
+            hit = fstrstr(hit, ilen - (hit - ifold), token, toklen);
         }
     }
+    qsort(h->spans, h->n, sizeof *h->spans, cmpspan);
+    return h;
+}
+
+/* draw the matching spans of item in the highlight scheme, placed with the
+ * advance widths of its text measured in a single pass */
+static void drawhighlights(size_t item, int x, int y, int maxw, int selected) {
+    static unsigned int *adv = NULL;
+    static size_t advsize = 0;
+    struct highlights *h = itemspans(item);
+    struct span *sp;
+    size_t i, end = 0;
+    int indentx;
+
+    if (!h->n)
+        return;
+    for (i = 0; i < h->n; i++)
+        end = MAX(end, h->spans[i].off + h->spans[i].len);
+    if (end + 1 > advsize && !(adv = realloc(adv, (advsize = end + 1) * sizeof *adv)))
+        die("cannot realloc %u bytes:", advsize * sizeof *adv);
+    drw_fontset_getadvances(drw, itemtext(item), end, adv);
+
+    drw_setscheme(drw, scheme[selected ? SchemeSelHighlight : SchemeNormHighlight]);
+    for (i = 0; i < h->n; i++) {
+        sp = &h->spans[i];
+        indentx = adv[sp->off] + lrpad;
+        if (indentx - (lrpad / 2) - 1 < maxw)
+            drw_textn(drw, x + indentx - (lrpad / 2) - 1, y, MIN(maxw - indentx, (int)(adv[sp->off + sp->len] - adv[sp->off])),
+                bh, 0, itemtext(item) + sp->off, sp->len, 0);
+    }
 }
 
-static int drawitem(struct item *item, int x, int y, int w) {
-    if (item == sel)
+/* draw the item at position k of the matches */
+static int drawitem(size_t k, int x, int y, int w) {
+    size_t item = matches[k];
+
+    if (k == sel)
         drw_setscheme(drw, scheme[SchemeSel]);
-    else if (item->out)
+    else if (itemout(item))
         drw_setscheme(drw, scheme[SchemeOut]);
     else
         drw_setscheme(drw, scheme[SchemeNorm]);
 
-    int r = drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
-    drawhighlights(item, x, y, w);
+    int r = drw_textn(drw, x, y, w, bh, lrpad / 2, itemtext(item), lens[item], 0);
+    drawhighlights(item, x, y, w, k == sel);
     return r;
 }
 
 static void recalculatenumbers(void) {
-    unsigned int numer = 0, denom = 0;
-    struct item *item;
-    if (matchend) {
-        numer++;
-        for (item = matchend; item && item->left; item = item->left)
-            numer++;
+    char buf[NUMBERSBUFSIZE];
+
+    if (streaming) /* show that more items may still arrive */
+        snprintf(buf, sizeof buf, "%c %zu/%zu", "-\\|/"[spinner % 4], nmatches, nitems);
+    else
+        snprintf(buf, sizeof buf, "%zu/%zu", nmatches, nitems);
+    /* only measure the counter again when it changed */
+    if (strcmp(buf, numbers)) {
+        strcpy(numbers, buf);
+        numbersw = TEXTW(numbers);
     }
-    for (item = items; item && item->text; item++)
-        denom++;
-    snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
 }
 
-static void drawmenu(void) {
+/* draw the input field and the cursor; returns the width of the field */
+static int drawinput(void) {
     unsigned int curpos;
-    struct item *item;
-    int x = 0, y = 0, fh = drw->fonts->h, w;
-
-    drw_setscheme(drw, scheme[SchemeNorm]);
-    drw_rect(drw, 0, 0, mw, mh, 1, 1);
+    int x = (prompt && *prompt) ? promptw : 0, fh = drw->fonts->h, w;
 
-    if (prompt && *prompt) {
-        drw_setscheme(drw, scheme[SchemeSel]);
-        x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
-    }
-    /* draw input field */
-    w = (lines > 0 || !matches) ? mw - x : inputw;
+    w = (lines > 0 || !nmatches) ? mw - x : inputw;
     drw_setscheme(drw, scheme[SchemeNorm]);
     drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
 
@@ -220,33 +476,106 @@ static void drawmenu(void) {
         drw_setscheme(drw, scheme[SchemeNorm]);
         drw_rect(drw, x + curpos, 2 + (bh - fh) / 2, 2, fh - 4, 1, 0);
     }
+    return w;
+}
+
+/* find the cell of the match at position k on the current page; returns 0 if
+ * it is not shown */
+static int itemcell(size_t k, int *x, int *y, int *w) {
+    size_t i;
+    int x0 = (prompt && *prompt) ? promptw : 0;
+
+    if (k < curr || k >= next)
+        return 0;
+    if (lines > 0) {
+        *w = (mw - x0) / columns;
+        *x = x0 + ((k - curr) / lines) * *w;
+        *y = (((k - curr) % lines) + 1) * bh;
+        return 1;
+    }
+    *x = x0 + inputw + larroww;
+    *y = 0;
+    for (i = curr;; i++) {
+        *w = MIN(itemw(matches[i]), mw - *x - rarroww - numbersw);
+        if (i == k)
+            return 1;
+        *x += *w;
+    }
+}
+
+/* redraw only the cell of the match at position k and copy it to the window */
+static void drawcell(size_t k) {
+    int x, y, w;
+
+    if (itemcell(k, &x, &y, &w)) {
+        drawitem(k, x, y, w);
+        drw_map(drw, win, x, y, w, bh);
+    }
+}
+
+static void drawmenu(void) {
+    size_t k;
+    int x = 0, y = 0, w;
+
+    drw_setscheme(drw, scheme[SchemeNorm]);
+    drw_rect(drw, 0, 0, mw, mh, 1, 1);
+
+    if (prompt && *prompt) {
+        drw_setscheme(drw, scheme[SchemeSel]);
+        x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
+    }
+    drawinput();
+    dirty = 0;
 
     recalculatenumbers();
     if (lines > 0) {
         /* draw grid */
         int i = 0;
-        for (item = curr; item != next; item = item->right, i++)
-            drawitem(item, x + ((i / lines) * ((mw - x) / columns)), y + (((i % lines) + 1) * bh), (mw - x) / columns);
-    } else if (matches) {
+        for (k = curr; k < next; k++, i++)
+            drawitem(k, x + ((i / lines) * ((mw - x) / columns)), y + (((i % lines) + 1) * bh), (mw - x) / columns);
+    } else if (nmatches) {
         /* draw horizontal list */
         x += inputw;
-        w = TEXTW("<");
-        if (curr->left) {
+        w = larroww;
+        if (curr > 0) {
             drw_setscheme(drw, scheme[SchemeNorm]);
             drw_text(drw, x, 0, w, bh, lrpad / 2, "<", 0);
         }
         x += w;
-        for (item = curr; item != next; item = item->right)
-            x = drawitem(item, x, 0, MIN(TEXTW(item->text), mw - x - TEXTW(">") - TEXTW(numbers)));
-        if (next) {
-            w = TEXTW(">");
+        for (k = curr; k < next; k++)
+            x = drawitem(k, x, 0, MIN(itemw(matches[k]), mw - x - rarroww - numbersw));
+        if (next < nmatches) {
+            w = rarroww;
             drw_setscheme(drw, scheme[SchemeNorm]);
-            drw_text(drw, mw - w - TEXTW(numbers), 0, w, bh, lrpad / 2, ">", 0);
+            drw_text(drw, mw - w - numbersw, 0, w, bh, lrpad / 2, ">", 0);
         }
     }
     drw_setscheme(drw, scheme[SchemeNorm]);
-    drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), bh, lrpad / 2, numbers, 0);
+    drw_text(drw, mw - numbersw, 0, numbersw, bh, lrpad / 2, numbers, 0);
     drw_map(drw, win, 0, 0, mw, mh);
+    shownsel = sel;
+    showncurr = curr;
+    showncursor = cursor;
+    strcpy(showntext, text);
+}
+
+static void finish(int status);
+
+/* report an error like die(), but end only the menu if it is one of a daemon,
+ * whose client then gets the error on its stderr */
+static void fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    if (fmt[0] && fmt[strlen(fmt) - 1] == ':') {
+        fputc(' ', stderr);
+        perror(NULL);
+    } else {
+        fputc('\n', stderr);
+    }
+    finish(1);
 }
 
 static void grabfocus(void) {
@@ -261,7 +590,7 @@ static void grabfocus(void) {
         XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
         nanosleep(&ts, NULL);
     }
-    die("cannot grab focus");
+    fail("cannot grab focus");
 }
 
 static void grabkeyboard(void) {
@@ -276,67 +605,355 @@ static void grabkeyboard(void) {
             return;
         nanosleep(&ts, NULL);
     }
-    die("cannot grab keyboard");
+    fail("cannot grab keyboard");
 }
 
-static void match(void) {
-    static char **tokv = NULL;
-    static int tokn = 0;
+static void poplevel(void) {
+    nlevels--;
+    free(levels[nlevels].text);
+    free(levels[nlevels].idx);
+}
 
-    char buf[sizeof text], *s;
-    int i, tokc = 0;
-    size_t len, textsize;
-    struct item *item, *lprefix, *lsubstr, *prefixend, *substrend;
+static int matchestokens(size_t item, struct query *q) {
+    int i;
 
-    strcpy(buf, text);
-    /* separate input text into tokens to be matched individually */
-    for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-        if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-            die("cannot realloc %u bytes:", tokn * sizeof *tokv);
-    len = tokc ? strlen(tokv[0]) : 0;
+    /* an item shorter than a token cannot contain it, not even fuzzily */
+    if (lens[item] < q->maxlen)
+        return 0;
+    for (i = 0; i < q->tokc; i++)
+        if (fuzzy ? !fuzzy_match(itemtext(item), itemfold(item), lens[item], q->tokv[i], q->toklen[i], NULL, NULL)
+                  : !fstrstr(itemfold(item), lens[item], q->tokv[i], q->toklen[i]))
+            return 0;
+    return 1;
+}
 
-    if (use_prefix) {
-        matches = lprefix = matchend = prefixend = NULL;
-        textsize = strlen(text);
-    } else {
-        matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-        textsize = strlen(text) + 1;
+/* shards to split n items into; the workers are only started once a menu is
+ * large enough to need more than one */
+static size_t nshards(size_t n) {
+    if (n < 2 * SHARDMIN)
+        return 1;
+    return MIN(n / SHARDMIN, MIN(MAXSHARDS, pool_size() * 4));
+}
+
+static void filtershard(size_t shard, void *arg) {
+    struct filterjob *job = arg;
+    size_t i, lo = job->n * shard / job->nshards, hi = job->n * (shard + 1) / job->nshards, c = 0;
+    unsigned int idx;
+
+    /* a shard only writes to its own part of out */
+    for (i = lo; i < hi; i++) {
+        idx = job->src ? job->src[i] : job->from + i;
+        if (matchestokens(idx, job->q))
+            job->out[lo + c++] = idx;
     }
-    for (item = items; item && item->text; item++) {
-        for (i = 0; i < tokc; i++)
-            if (!fstrstr(item->text, tokv[i]))
-                break;
-        if (i != tokc) /* not all tokens match */
-            continue;
-        /* exact matches go first, then prefixes, then substrings */
-        if (!tokc || !fstrncmp(text, item->text, textsize))
-            appenditem(item, &matches, &matchend);
-        else if (!fstrncmp(tokv[0], item->text, len))
-            appenditem(item, &lprefix, &prefixend);
-        else if (!use_prefix)
-            appenditem(item, &lsubstr, &substrend);
+    job->count[shard] = c;
+}
+
+/* write the candidates matching all tokens to out, in their original order;
+ * the candidates are src[0..n) or, if src is NULL, the items from..from+n-1 */
+static size_t filteritems(const unsigned int *src, size_t from, size_t n, unsigned int *out, struct query *q) {
+    struct filterjob job = {.src = src, .from = from, .n = n, .out = out, .q = q};
+    size_t count[MAXSHARDS], i, c;
+
+    job.nshards = nshards(n);
+    job.count = count;
+    pool_run(job.nshards, filtershard, &job);
+    for (c = 0, i = 0; i < job.nshards; c += count[i++])
+        memmove(out + c, out + n * i / job.nshards, count[i] * sizeof *out);
+    return c;
+}
+
+/* add the items read since lvl was computed, in case stdin is still streaming */
+static void scannew(struct matchlevel *lvl, struct query *q) {
+    if (lvl->scanned == nitems)
+        return;
+    if (!(lvl->idx = realloc(lvl->idx, (lvl->n + nitems - lvl->scanned) * sizeof *lvl->idx)))
+        die("cannot realloc %u bytes:", (lvl->n + nitems - lvl->scanned) * sizeof *lvl->idx);
+    lvl->n += filteritems(NULL, lvl->scanned, nitems - lvl->scanned, lvl->idx + lvl->n, q);
+    lvl->scanned = nitems;
+}
+
+/* take the candidates of a query from the trigram index of its longest token,
+ * once the index is built, if that token has at least three bytes and fewer
+ * than limit items may contain it; returns 0 if the index is not used */
+static int indexlookup(struct matchlevel *lvl, struct query *q, size_t limit) {
+    Trigram *t;
+    unsigned int *ids;
+    size_t n;
+    int i, tok = -1;
+
+    pthread_mutex_lock(&tindexlock);
+    t = tindex;
+    pthread_mutex_unlock(&tindexlock);
+    for (i = 0; i < q->tokc; i++)
+        if (q->toklen[i] >= 3 && (tok < 0 || q->toklen[i] > q->toklen[tok]))
+            tok = i;
+    if (!t || tok < 0 || !limit)
+        return 0;
+    if ((n = trigram_find(t, q->tokv[tok], q->toklen[tok], &ids)) >= limit) {
+        free(ids);
+        return 0;
     }
-    if (lprefix) {
-        if (matches) {
-            matchend->right = lprefix;
-            lprefix->left = matchend;
-        } else
-            matches = lprefix;
-        matchend = prefixend;
+    /* the index over-approximates, so the candidates are still verified */
+    lvl->idx = ids;
+    lvl->n = filteritems(ids, 0, n, ids, q);
+    lvl->scanned = tindexn;
+    return 1;
+}
+
+/* return the candidates for the current query, reusing or narrowing the
+ * result of an earlier query whenever the current one only extends it */
+static struct matchlevel *pushlevel(struct query *q) {
+    struct matchlevel *top, *lvl;
+    size_t n, limit;
+
+    /* every item matching the new tokens also matches the tokens of any query
+     * that is a prefix of it, so only those levels remain useful */
+    while (nlevels && strncmp(levels[nlevels - 1].text, text, strlen(levels[nlevels - 1].text)))
+        poplevel();
+    top = nlevels ? &levels[nlevels - 1] : NULL;
+    if (top && !strcmp(top->text, text)) {
+        scannew(top, q);
+        return top;
     }
-    if (!use_prefix && lsubstr) {
-        if (matches) {
-            matchend->right = lsubstr;
-            lsubstr->left = matchend;
-        } else
-            matches = lsubstr;
-        matchend = substrend;
+
+    if (nlevels == levelsize && !(levels = realloc(levels, (levelsize += 16) * sizeof *levels)))
+        die("cannot realloc %u bytes:", levelsize * sizeof *levels);
+    lvl = &levels[nlevels];
+    lvl->maxlen = q->maxlen;
+    if (!(lvl->text = strdup(text)))
+        die("cannot strdup %u bytes:", strlen(text) + 1);
+
+    /* the index narrows down the candidates unless the previous level was
+     * narrowed by a token at least as long already, or has fewer of them */
+    limit = !top || top->maxlen < 3 ? (size_t)-1 : q->maxlen > top->maxlen ? top->n : 0;
+    if (fuzzy || !indexlookup(lvl, q, limit)) {
+        n = top ? top->n : 0;
+        if (!(lvl->idx = malloc(MAX(n, 1) * sizeof *lvl->idx)))
+            die("cannot malloc %u bytes:", MAX(n, 1) * sizeof *lvl->idx);
+        lvl->n = top ? filteritems(top->idx, 0, n, lvl->idx, q) : 0;
+        lvl->scanned = top ? top->scanned : 0;
     }
+    /* the candidates were allocated for before filtering, and the stack keeps
+     * every level while the text grows */
+    if (!(lvl->idx = realloc(lvl->idx, MAX(lvl->n, 1) * sizeof *lvl->idx)))
+        die("cannot realloc %u bytes:", MAX(lvl->n, 1) * sizeof *lvl->idx);
+    scannew(lvl, q);
+    nlevels++;
+    return lvl;
+}
+
+static void classifyshard(size_t shard, void *arg) {
+    struct classifyjob *job = arg;
+    size_t i, lo = job->n * shard / job->nshards, hi = job->n * (shard + 1) / job->nshards;
+    struct query *q = job->q;
+    const char *s;
+    size_t l;
+
+    /* exact matches go first, then prefixes, then substrings; with use_prefix
+     * an item starting with the whole text counts as exact */
+    for (i = lo; i < hi; i++) {
+        s = itemfold(job->idx[i]);
+        l = lens[job->idx[i]];
+        if (!q->tokc || ((use_prefix ? l >= q->textlen : l == q->textlen) && !memcmp(q->text, s, q->textlen)))
+            job->class[i] = MatchExact;
+        else if (l >= q->len && !memcmp(q->tokv[0], s, q->len))
+            job->class[i] = MatchPrefix;
+        else
+            job->class[i] = use_prefix ? MatchNone : MatchSubstr;
+    }
+}
+
+static void scoreshard(size_t shard, void *arg) {
+    struct scorejob *job = arg;
+    size_t i, lo = job->n * shard / job->nshards, hi = job->n * (shard + 1) / job->nshards;
+    struct query *q = job->q;
+    size_t item;
+    int t, sc;
+
+    for (i = lo; i < hi; i++) {
+        item = job->idx[i];
+        for (job->score[i] = 0, t = 0; t < q->tokc; t++) {
+            fuzzy_match(itemtext(item), itemfold(item), lens[item], q->tokv[t], q->toklen[t], &sc, NULL);
+            job->score[i] += sc;
+        }
+    }
+}
+
+/* whether a ranks below b: lower score, or the same score but a lower history
+ * score or later input */
+static int worse(struct scored a, struct scored b) {
+    return a.score < b.score || (a.score == b.score && (a.rank < b.rank || (a.rank == b.rank && a.i > b.i)));
+}
+
+static int cmpscored(const void *a, const void *b) {
+    return worse(*(const struct scored *)a, *(const struct scored *)b) ? 1 : -1;
+}
+
+/* order the candidates of lvl with the FUZZYTOPK best scores first, best to
+ * worst, and then the others in input order; picking the best with a heap
+ * avoids sorting all candidates */
+static void fuzzyrank(struct matchlevel *lvl, struct query *q) {
+    static int *score = NULL;
+    static size_t scoresize = 0;
+    struct scored heap[FUZZYTOPK], e;
+    struct scorejob job;
+    size_t i, k, c, n = 0;
+
+    if (lvl->n > scoresize && !(score = realloc(score, (scoresize = lvl->n) * sizeof *score)))
+        die("cannot realloc %u bytes:", scoresize * sizeof *score);
+    job = (struct scorejob){.idx = lvl->idx, .n = lvl->n, .nshards = nshards(lvl->n), .score = score, .q = q};
+    if (q->tokc)
+        pool_run(job.nshards, scoreshard, &job);
+    else
+        memset(score, 0, lvl->n * sizeof *score);
+
+    /* min-heap of the best candidates seen so far, the worst on top */
+    for (i = 0; i < lvl->n; i++) {
+        e = (struct scored){.score = score[i], .rank = itemrank(lvl->idx[i]), .i = i};
+        if (n < FUZZYTOPK) {
+            for (k = n++; k > 0 && worse(e, heap[(k - 1) / 2]); k = (k - 1) / 2)
+                heap[k] = heap[(k - 1) / 2];
+            heap[k] = e;
+        } else if (worse(heap[0], e)) {
+            /* replace the worst one and sift it down */
+            for (k = 0; (c = 2 * k + 1) < n; k = c) {
+                if (c + 1 < n && worse(heap[c + 1], heap[c]))
+                    c++;
+                if (!worse(heap[c], e))
+                    break;
+                heap[k] = heap[c];
+            }
+            heap[k] = e;
+        }
+    }
+    qsort(heap, n, sizeof *heap, cmpscored);
+
+    for (i = 0; i < n; i++) {
+        matches[nmatches++] = lvl->idx[heap[i].i];
+        score[heap[i].i] = INT_MIN; /* taken */
+    }
+    for (i = 0; i < lvl->n; i++)
+        if (score[i] != INT_MIN)
+            matches[nmatches++] = lvl->idx[i];
+}
+
+static int cmprank(const void *a, const void *b) {
+    unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+    float ra = ranks[ia], rb = ranks[ib];
+
+    return ra != rb ? (ra < rb) - (ra > rb) : (ia > ib) - (ia < ib);
+}
+
+/* move the items of matches lo..hi-1 selected before to their front, by
+ * decreasing history score, keeping the input order of the others and of ties */
+static void rankhistory(size_t lo, size_t hi) {
+    static unsigned int *ranked = NULL;
+    static size_t rankedsize = 0;
+    size_t i, n = 0, k = hi;
+
+    if (hi - lo > rankedsize && !(ranked = realloc(ranked, (rankedsize = hi - lo) * sizeof *ranked)))
+        die("cannot realloc %u bytes:", rankedsize * sizeof *ranked);
+    for (i = hi; i-- > lo;)
+        if (ranks[matches[i]] > 0)
+            ranked[n++] = matches[i];
+        else
+            matches[--k] = matches[i];
+    qsort(ranked, n, sizeof *ranked, cmprank);
+    memcpy(matches + lo, ranked, n * sizeof *ranked);
+}
+
+/* Match the items against the text on the worker pool. The event thread waits
+ * for the match rather than running it in the background, as reading stdin
+ * moves the items; keys pressed meanwhile stay queued and are handled in one
+ * batch afterwards. */
+static void match(void) {
+    static char **tokv = NULL;
+    static size_t *toklen = NULL;
+    static int tokn = 0;
+    static unsigned char *class = NULL;
+    static size_t classsize = 0;
+
+    static char buf[sizeof text], ftext[sizeof text]; /* kept in query */
+    char *s;
+    struct query q = {.text = ftext};
+    struct classifyjob job;
+    size_t i, start[MatchNone + 1];
+    struct matchlevel *lvl;
+
+    strcpy(ftext, text);
+    if (icase)
+        search_fold(ftext, ftext, strlen(ftext));
+    strcpy(buf, ftext);
+    /* separate input text into tokens to be matched individually */
+    for (s = strtok(buf, " "); s; tokv[q.tokc - 1] = s, s = strtok(NULL, " "))
+        if (++q.tokc > tokn && (!(tokv = realloc(tokv, ++tokn * sizeof *tokv)) ||
+                                   !(toklen = realloc(toklen, tokn * sizeof *toklen))))
+            die("cannot realloc %u bytes:", tokn * sizeof *tokv);
+    for (i = 0; i < (size_t)q.tokc; i++)
+        q.maxlen = MAX(q.maxlen, (toklen[i] = strlen(tokv[i])));
+    q.tokv = tokv;
+    q.toklen = toklen;
+    q.len = q.tokc ? toklen[0] : 0;
+    q.textlen = strlen(q.text);
+
+    query = q;
+    matchgen++;
+    nmatches = 0;
+    curr = sel = 0;
+    dirty = 1;
+    rematch = 0;
+    lvl = pushlevel(&q);
+    if (lvl->n > matchsize && !(matches = realloc(matches, (matchsize = lvl->n) * sizeof *matches)))
+        die("cannot realloc %u bytes:", matchsize * sizeof *matches);
+    if (fuzzy) {
+        fuzzyrank(lvl, &q);
+        calcoffsets();
+        return;
+    }
+    if (lvl->n > classsize && !(class = realloc(class, (classsize = lvl->n))))
+        die("cannot realloc %u bytes:", classsize);
+    job = (struct classifyjob){.idx = lvl->idx, .n = lvl->n, .nshards = nshards(lvl->n), .class = class, .q = &q};
+    pool_run(job.nshards, classifyshard, &job);
+    /* place each class after the ones before it, keeping input order */
+    memset(start, 0, sizeof start);
+    for (i = 0; i < lvl->n; i++)
+        if (class[i] != MatchNone)
+            start[class[i] + 1]++;
+    for (i = 1; i <= MatchNone; i++)
+        start[i] += start[i - 1];
+    nmatches = start[MatchNone];
+    for (i = 0; i < lvl->n; i++)
+        if (class[i] != MatchNone)
+            matches[start[class[i]]++] = lvl->idx[i];
+    /* each class now ends where the next one starts */
+    for (i = 0; history && i < MatchNone; i++)
+        rankhistory(i ? start[i - 1] : 0, start[i]);
 
-    curr = sel = matches;
     calcoffsets();
 }
 
+/* match the text if it was edited and redraw only what changed since the
+ * window was last drawn, unless the matches or the page changed */
+static void drawchanges(void) {
+    if (rematch)
+        match();
+    if (dirty || curr != showncurr) {
+        drawmenu();
+        return;
+    }
+    if (cursor != showncursor || strcmp(text, showntext)) {
+        drw_map(drw, win, (prompt && *prompt) ? promptw : 0, 0, drawinput(), bh);
+        showncursor = cursor;
+        strcpy(showntext, text);
+    }
+    if (sel != shownsel) {
+        drawcell(shownsel);
+        drawcell(sel);
+        shownsel = sel;
+    }
+}
+
 static void insert(const char *str, ssize_t n) {
     if (strlen(text) + n > sizeof text - 1)
         return;
@@ -345,7 +962,7 @@ static void insert(const char *str, ssize_t n) {
     if (n > 0)
         memcpy(&text[cursor], str, n);
     cursor += n;
-    match();
+    rematch = 1;
 }
 
 static size_t nextrune(int inc) {
@@ -371,15 +988,103 @@ static void movewordedge(int dir) {
     }
 }
 
+/* go back to the fonts and colors of the daemon */
+static void unloadlook(void) {
+    size_t i;
+
+    if (daemonfonts) {
+        drw_fontset_free(drw->fonts);
+        drw_setfontset(drw, daemonfonts);
+        daemonfonts = NULL;
+        lrpad = drw->fonts->h;
+    }
+    if (daemonscheme[0]) {
+        for (i = 0; i < SchemeLast; i++)
+            free(scheme[i]);
+        memcpy(scheme, daemonscheme, sizeof scheme);
+        daemonscheme[0] = NULL;
+    }
+}
+
+/* free what the menu used, for the daemon to start the next one afresh */
+static void endmenu(void) {
+    size_t i;
+
+    XUngrabKeyboard(dpy, CurrentTime);
+    /* a menu may fail before its window is made */
+    if (xic)
+        XDestroyIC(xic);
+    if (win)
+        XDestroyWindow(dpy, win);
+    xic = NULL;
+    win = 0;
+    if (embed)
+        XSelectInput(dpy, parentwin, NoEventMask);
+    XSync(dpy, True); /* drop the events left for the menu */
+    unloadlook();
+
+    if (indexing) {
+        pthread_mutex_lock(&tindexlock);
+        stopindex = 1;
+        pthread_mutex_unlock(&tindexlock);
+        pthread_join(indexthread, NULL);
+        indexing = stopindex = 0;
+    }
+    trigram_free(tindex);
+    tindex = NULL;
+    history_free(history);
+    history = NULL;
+    while (nlevels)
+        poplevel();
+
+    if (poolmapped)
+        munmap(pool, poolsize);
+    else
+        free(pool);
+    for (i = 0; i < foldsize; i++)
+        free(folds[i]);
+    free(folds);
+    free(offs);
+    free(lens);
+    free(widths);
+    free(outs);
+    free(ranks);
+    pool = NULL;
+    folds = NULL;
+    offs = NULL;
+    lens = widths = NULL;
+    outs = NULL;
+    ranks = NULL;
+    poolmapped = 0;
+    poollen = poolsize = foldsize = readstart = 0;
+    nitems = nread = itemsize = nmatches = widest = 0;
+
+    memset(text, 0, sizeof text);
+    numbers[0] = '\0'; /* measured again, the fonts may change */
+    cursor = 0;
+    inputw = 0;
+    spinner = 0;
+    rematch = 0;
+}
+
+/* end the menu with status: exit, or in a daemon, go back to serving */
+static void finish(int status) {
+    if (serving) {
+        endmenu();
+        longjmp(menuend, status + 1);
+    }
+    cleanup();
+    exit(status);
+}
+
+/* only updates the state, drawchanges() shows it once a batch of events is handled */
 static void keypress(XKeyEvent *ev) {
     char buf[32];
+    const char *s;
     int len;
-    struct item *item;
+    size_t k, n;
     KeySym ksym;
     Status status;
-    int i;
-    struct item *tmpsel;
-    bool offscreen = false;
 
     len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
     switch (status) {
@@ -437,7 +1142,7 @@ static void keypress(XKeyEvent *ev) {
 
             case XK_k: /* delete right */
                 text[cursor] = '\0';
-                match();
+                rematch = 1;
                 break;
             case XK_u: /* delete left */
                 insert(NULL, 0 - cursor);
@@ -454,16 +1159,15 @@ static void keypress(XKeyEvent *ev) {
                 return;
             case XK_Left:
                 movewordedge(-1);
-                goto draw;
+                return;
             case XK_Right:
                 movewordedge(+1);
-                goto draw;
+                return;
             case XK_Return:
             case XK_KP_Enter:
                 break;
             case XK_bracketleft:
-                cleanup();
-                exit(1);
+                finish(1);
             default:
                 return;
         }
@@ -471,10 +1175,10 @@ static void keypress(XKeyEvent *ev) {
         switch (ksym) {
             case XK_b:
                 movewordedge(-1);
-                goto draw;
+                return;
             case XK_f:
                 movewordedge(+1);
-                goto draw;
+                return;
             case XK_g:
                 ksym = XK_Home;
                 break;
@@ -498,6 +1202,11 @@ static void keypress(XKeyEvent *ev) {
         }
     }
 
+    /* text edits are matched once per batch of events, but the other keys
+     * act on the matches of the current text */
+    if (rematch && (IsCursorKey(ksym) || ksym == XK_Return || ksym == XK_KP_Enter || ksym == XK_Tab))
+        match();
+
     switch (ksym) {
         default:
         insert:
@@ -519,48 +1228,41 @@ static void keypress(XKeyEvent *ev) {
                 cursor = strlen(text);
                 break;
             }
-            if (next) {
+            if (next < nmatches) {
                 /* jump to end of list and position items in reverse */
-                curr = matchend;
+                curr = nmatches - 1;
                 calcoffsets();
                 curr = prev;
                 calcoffsets();
-                while (next && (curr = curr->right))
+                while (next < nmatches) {
+                    curr++;
                     calcoffsets();
+                }
             }
-            sel = matchend;
+            sel = nmatches ? nmatches - 1 : 0;
             break;
         case XK_Escape:
-            cleanup();
-            exit(1);
+            finish(1);
         case XK_Home:
-            if (sel == matches) {
+            if (sel == 0) {
                 cursor = 0;
                 break;
             }
-            sel = curr = matches;
+            sel = curr = 0;
             calcoffsets();
             break;
         case XK_Left:
             if (columns > 1) {
-                if (!sel)
+                if (sel >= nmatches || sel < lines)
                     return;
-                tmpsel = sel;
-                for (i = 0; i < lines; i++) {
-                    if (!tmpsel->left || tmpsel->left->right != tmpsel)
-                        return;
-                    if (tmpsel == curr)
-                        offscreen = true;
-                    tmpsel = tmpsel->left;
-                }
-                sel = tmpsel;
-                if (offscreen) {
+                sel -= lines;
+                if (sel < curr) { /* moved to the previous page */
                     curr = prev;
                     calcoffsets();
                 }
                 break;
             }
-            if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+            if (cursor > 0 && (sel == 0 || lines > 0)) {
                 cursor = nextrune(-1);
                 break;
             }
@@ -568,47 +1270,49 @@ static void keypress(XKeyEvent *ev) {
                 return;
             /* fallthrough */
         case XK_Up:
-            if (sel && sel->left && (sel = sel->left)->right == curr) {
+            if (sel > 0 && sel-- == curr) {
                 curr = prev;
                 calcoffsets();
             }
             break;
         case XK_Next:
-            if (!next)
+            if (next >= nmatches)
                 return;
             sel = curr = next;
             calcoffsets();
             break;
         case XK_Prior:
-            if (!prev)
+            if (!nmatches)
                 return;
             sel = curr = prev;
             calcoffsets();
             break;
         case XK_Return:
         case XK_KP_Enter:
-            puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
-            if (!(ev->state & ControlMask)) {
-                cleanup();
-                exit(0);
+            if (sel < nmatches && !(ev->state & ShiftMask)) {
+                s = itemtext(matches[sel]);
+                n = lens[matches[sel]];
+            } else {
+                s = text;
+                n = strlen(text);
+            }
+            fwrite(s, 1, n, stdout);
+            putchar('\n');
+            if (history)
+                history_add(history, s, n);
+            if (!(ev->state & ControlMask))
+                finish(0);
+            if (sel < nmatches) {
+                outs[matches[sel] / 8] |= 1 << (matches[sel] % 8);
+                shownsel = nmatches; /* its cell changed */
             }
-            if (sel)
-                sel->out = 1;
             break;
         case XK_Right:
             if (columns > 1) {
-                if (!sel)
+                if (sel + lines >= nmatches)
                     return;
-                tmpsel = sel;
-                for (i = 0; i < lines; i++) {
-                    if (!tmpsel->right || tmpsel->right->left != tmpsel)
-                        return;
-                    tmpsel = tmpsel->right;
-                    if (tmpsel == next)
-                        offscreen = true;
-                }
-                sel = tmpsel;
-                if (offscreen) {
+                sel += lines;
+                if (sel >= next) { /* moved to the next page */
                     curr = next;
                     calcoffsets();
                 }
@@ -622,29 +1326,25 @@ static void keypress(XKeyEvent *ev) {
                 return;
             /* fallthrough */
         case XK_Down:
-            if (sel && sel->right && (sel = sel->right) == next) {
+            if (sel + 1 < nmatches && ++sel == next) {
                 curr = next;
                 calcoffsets();
             }
             break;
         case XK_Tab:
-            if (!matches)
+            if (!nmatches)
                 break; /* cannot complete no matches */
-            strncpy(text, matches->text, sizeof text - 1);
-            text[sizeof text - 1] = '\0';
-            len = cursor = strlen(text); /* length of longest common prefix */
-            for (item = matches; item && item->text; item = item->right) {
-                cursor = 0;
-                while (cursor < len && text[cursor] == item->text[cursor])
-                    cursor++;
+            len = MIN(lens[matches[0]], sizeof text - 1); /* length of longest common prefix */
+            memcpy(text, itemtext(matches[0]), len);
+            for (k = 0; k < nmatches; k++) {
+                for (cursor = 0; cursor < len && cursor < lens[matches[k]]; cursor++)
+                    if (text[cursor] != itemtext(matches[k])[cursor])
+                        break;
                 len = cursor;
             }
-            memset(text + len, '\0', strlen(text) - len);
+            memset(text + len, '\0', sizeof text - len);
             break;
     }
-
-draw:
-    drawmenu();
 }
 
 static void paste(void) {
@@ -659,7 +1359,6 @@ static void paste(void) {
         insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
         XFree(p);
     }
-    drawmenu();
 }
 
 static void xinitvisual(void) {
@@ -693,51 +1392,149 @@ static void xinitvisual(void) {
     }
 }
 
+/* Store the case-folded texts of the items from..to-1 for matching with -i.
+ * They are folded by chunks of FOLDCHUNK items, stored one after another, and
+ * only the chunks folding changes are copied, so that a mapped input is not
+ * copied as a whole. */
+static void foldtext(size_t from, size_t to) {
+    size_t c, n = (to + FOLDCHUNK - 1) / FOLDCHUNK, first, last, base, lo, hi;
+    char *f;
+    int folded;
+
+    if (!icase || from == to)
+        return;
+    if (foldsize < n) {
+        if (!(folds = realloc(folds, MAX(n, foldsize * 2) * sizeof *folds)))
+            die("cannot realloc %u bytes:", MAX(n, foldsize * 2) * sizeof *folds);
+        memset(folds + foldsize, 0, (MAX(n, foldsize * 2) - foldsize) * sizeof *folds);
+        foldsize = MAX(n, foldsize * 2);
+    }
+    for (c = from / FOLDCHUNK; c < n; c++) {
+        first = c * FOLDCHUNK;
+        last = MIN(to, first + FOLDCHUNK) - 1;
+        base = offs[first];
+        lo = offs[MAX(from, first)];
+        hi = offs[last] + lens[last];
+        folded = folds[c] != NULL;
+        if (!(f = realloc(folds[c], hi - base)))
+            die("cannot realloc %u bytes:", hi - base);
+        /* the items of the chunk folded before were left as they are */
+        if (!folded)
+            memcpy(f, pool + base, lo - base);
+        if (search_fold(f + lo - base, pool + lo, hi - lo) || folded)
+            folds[c] = f;
+        else
+            free(f);
+    }
+}
+
+static void additem(size_t off, size_t len) {
+    if (nread == itemsize) {
+        itemsize = MAX(BUFSIZ, itemsize * 2);
+        if (!(offs = realloc(offs, itemsize * sizeof *offs)) || !(lens = realloc(lens, itemsize * sizeof *lens)) ||
+            !(widths = realloc(widths, itemsize * sizeof *widths)) || !(outs = realloc(outs, itemsize / 8)))
+            die("cannot realloc %u bytes:", itemsize * sizeof *offs);
+        memset(outs + nread / 8, 0, (itemsize - nread) / 8);
+    }
+    offs[nread] = off;
+    lens[nread] = len;
+    widths[nread] = 0;
+    nread++;
+}
+
+/* show the items read so far */
+static void showitems(void) {
+    size_t i;
+
+    if (history && nread > nitems) {
+        if (!(ranks = realloc(ranks, itemsize * sizeof *ranks)))
+            die("cannot realloc %u bytes:", itemsize * sizeof *ranks);
+        for (i = nitems; i < nread; i++)
+            ranks[i] = history_score(history, itemtext(i), lens[i]);
+    }
+    foldtext(nitems, nread);
+    widest = estimatewidest(nitems, nread, widest);
+    nitems = nread;
+}
+
 static void readargv(void) {
-    size_t len = 0;
-    for (char **it = argv_items; *it; ++it, ++len) { }
-    items = calloc(len + 1, sizeof(struct item));
-    items[len].text = NULL;
-    char const *max_text = NULL;
-    unsigned int max_w = 0;
-    for (size_t i = 0; i < len; ++i) {
-        items[i].text = argv_items[i];
-        unsigned int tmp;
-        drw_font_getexts(drw->fonts, items[i].text, strlen(items[i].text), &tmp, NULL);
-        if (tmp > max_w) {
-            max_w = tmp;
-            max_text = items[i].text;
-        }
+    size_t len;
+    char **it;
+
+    for (it = argv_items; *it; it++)
+        poolsize += strlen(*it) + 1;
+    if (!(pool = malloc(MAX(poolsize, 1))))
+        die("cannot malloc %u bytes:", MAX(poolsize, 1));
+    for (it = argv_items; *it; it++) {
+        len = strlen(*it);
+        memcpy(pool + poollen, *it, len + 1);
+        additem(poollen, len);
+        poollen += len + 1;
     }
-    inputw = max_text ? TEXTW(max_text) : 0;
-    lines = MIN(lines, len);
+    showitems();
+    inputw = max_textw();
+    lines = MIN(lines, nitems);
 }
 
-static void readstdin(void) {
-    char buf[sizeof text], *p;
-    size_t i, imax = 0, size = 0;
-    unsigned int tmpmax = 0;
-
-    /* read each line from stdin and add it to the item list */
-    for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-        if (i + 1 >= size / sizeof *items)
-            if (!(items = realloc(items, (size += BUFSIZ))))
-                die("cannot realloc %u bytes:", size);
-        if ((p = strchr(buf, '\n')))
-            *p = '\0';
-        if (!(items[i].text = strdup(buf)))
-            die("cannot strdup %u bytes:", strlen(buf) + 1);
-        items[i].out = 0;
-        drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
-        if (tmpmax > inputw) {
-            inputw = tmpmax;
-            imax = i;
-        }
+/* read the next block of stdin into the pool and split it into items;
+ * returns 0 once end-of-file is reached */
+static int readchunk(void) {
+    char *s, *p;
+    ssize_t n;
+
+    /* items are offsets into the pool, so it may move */
+    if (poollen == poolsize && !(pool = realloc(pool, (poolsize = MAX(CHUNKSIZE, poolsize * 2)))))
+        die("cannot realloc %u bytes:", poolsize);
+    if ((n = read(STDIN_FILENO, pool + poollen, poolsize - poollen)) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 1;
+        fail("cannot read stdin:");
+    }
+    for (s = pool + poollen; (p = memchr(s, '\n', pool + poollen + n - s)); s = p + 1) {
+        additem(readstart, p - pool - readstart);
+        readstart = p + 1 - pool;
     }
-    if (items)
-        items[i].text = NULL;
-    inputw = items ? TEXTW(items[imax].text) : 0;
-    lines = MIN(lines, i);
+    poollen += n;
+    if (n == 0 && readstart < poollen) {
+        additem(readstart, poollen - readstart);
+        readstart = poollen;
+    }
+    return n != 0;
+}
+
+/* use a regular file given on stdin as the pool: it is mapped read-only and
+ * the items point into the mapping, so their texts are never copied and
+ * share their pages with the page cache */
+static int mapstdin(void) {
+    struct stat st;
+    off_t off;
+    char *map, *s, *p, *end;
+
+    if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode) || (off = lseek(STDIN_FILENO, 0, SEEK_CUR)) < 0 ||
+        off >= st.st_size)
+        return 0;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, STDIN_FILENO, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    for (s = map + off, end = map + st.st_size; s < end; s = p + 1) {
+        if (!(p = memchr(s, '\n', end - s)))
+            p = end;
+        additem(s - map, p - s);
+    }
+    pool = map;
+    poollen = poolsize = st.st_size;
+    poolmapped = 1;
+    return 1;
+}
+
+static void readstdin(void) {
+    if (!mapstdin())
+        while (readchunk())
+            ;
+    showitems();
+    inputw = max_textw();
+    lines = MIN(lines, nitems);
 }
 
 static void readinput(void) {
@@ -747,60 +1544,164 @@ static void readinput(void) {
         readstdin();
 }
 
+/* show the lines read while streaming and rematch, keeping the selection */
+static void flushpending(void) {
+    size_t selidx, curridx, k;
+
+    selidx = sel < nmatches ? matches[sel] : (size_t)-1;
+    curridx = curr < nmatches ? matches[curr] : (size_t)-1;
+    showitems();
+    inputw = MIN(max_textw(), mw / 3);
+
+    match();
+    /* find the same items in the new matches */
+    for (k = 0; k < nmatches; k++) {
+        if (matches[k] == curridx)
+            curr = k;
+        if (matches[k] == selidx)
+            sel = k;
+    }
+    calcoffsets();
+    if (sel < curr || sel >= next) {
+        curr = sel;
+        calcoffsets();
+    }
+    spinner++;
+    drawmenu();
+}
+
+static void *buildindex(void *arg) {
+    Trigram *t = trigram_create();
+    size_t i;
+    int stop = 0;
+
+    /* the daemon may end the menu meanwhile, see every so often whether it did */
+    for (i = 0; i < tindexn && !stop; i++) {
+        trigram_add(t, i, itemfold(i), lens[i]);
+        if (i % 65536 == 65535) {
+            pthread_mutex_lock(&tindexlock);
+            stop = stopindex;
+            pthread_mutex_unlock(&tindexlock);
+        }
+    }
+    pthread_mutex_lock(&tindexlock);
+    if (!stopindex) {
+        tindex = t;
+        t = NULL;
+    }
+    pthread_mutex_unlock(&tindexlock);
+    trigram_free(t);
+    return arg;
+}
+
+/* index large menus in the background once all items are read; until the
+ * index is ready, and if it cannot be built, queries scan all items */
+static void startindex(void) {
+    if (fuzzy || !index_min || nitems < index_min)
+        return;
+    tindexn = nitems;
+    indexing = !pthread_create(&indexthread, NULL, buildindex, NULL);
+}
+
+static long elapsedms(const struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void handleevent(XEvent *ev) {
+    if (XFilterEvent(ev, win))
+        return;
+    switch (ev->type) {
+        case DestroyNotify:
+            if (ev->xdestroywindow.window != win)
+                break;
+            finish(1);
+        case Expose:
+            if (ev->xexpose.count == 0)
+                drw_map(drw, win, 0, 0, mw, mh);
+            break;
+        case FocusIn:
+            /* regrab focus from parent window */
+            if (ev->xfocus.window != win)
+                grabfocus();
+            break;
+        case KeyPress:
+            keypress(&ev->xkey);
+            break;
+        case SelectionNotify:
+            if (ev->xselection.property == utf8)
+                paste();
+            break;
+        case VisibilityNotify:
+            if (ev->xvisibility.state != VisibilityUnobscured)
+                XRaiseWindow(dpy, win);
+            break;
+    }
+}
 
 static void run(void) {
     XEvent ev;
-
+    struct pollfd fds[2] = {
+        {.fd = ConnectionNumber(dpy), .events = POLLIN},
+        {  .fd = STDIN_FILENO, .events = POLLIN},
+    };
+    struct timespec last = {0};
+    long timeout;
+
+    /* while streaming, wait on both the X connection and stdin; new items are
+     * only matched and drawn every stream_interval milliseconds */
+    while (streaming) {
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            handleevent(&ev);
+        }
+        drawchanges();
+        timeout = nread > nitems ? MAX(0, stream_interval - elapsedms(&last)) : -1;
+        if (poll(fds, LENGTH(fds), timeout) < 0 && errno != EINTR)
+            fail("poll:");
+        if (fds[1].revents)
+            streaming = readchunk();
+        if (nread > nitems && (!streaming || elapsedms(&last) >= stream_interval)) {
+            flushpending();
+            clock_gettime(CLOCK_MONOTONIC, &last);
+        } else if (!streaming)
+            drawmenu();
+    }
+    startindex();
     while (!XNextEvent(dpy, &ev)) {
-        if (XFilterEvent(&ev, win))
-            continue;
-        switch (ev.type) {
-            case DestroyNotify:
-                if (ev.xdestroywindow.window != win)
-                    break;
-                cleanup();
-                exit(1);
-            case Expose:
-                if (ev.xexpose.count == 0)
-                    drw_map(drw, win, 0, 0, mw, mh);
-                break;
-            case FocusIn:
-                /* regrab focus from parent window */
-                if (ev.xfocus.window != win)
-                    grabfocus();
-                break;
-            case KeyPress:
-                keypress(&ev.xkey);
-                break;
-            case SelectionNotify:
-                if (ev.xselection.property == utf8)
-                    paste();
-                break;
-            case VisibilityNotify:
-                if (ev.xvisibility.state != VisibilityUnobscured)
-                    XRaiseWindow(dpy, win);
-                break;
+        handleevent(&ev);
+        /* handle a whole burst of events, such as fast typing, before
+         * matching and drawing once */
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            handleevent(&ev);
         }
+        drawchanges();
     }
 }
 
+static void loadschemes(void) {
+    int j;
+
+    for (j = 0; j < SchemeLast; j++)
+        scheme[j] = drw_scm_create(drw, colors[j], alphas[j], 2);
+}
+
 static void setup(void) {
-    int x, y, i, j;
+    int x, y, i;
     unsigned int du;
     XSetWindowAttributes swa;
-    XIM xim;
+    static XIM xim = NULL; /* kept for the next menus of a daemon */
     Window w, dw, *dws;
     XWindowAttributes wa;
     XClassHint ch = {"dmenu", "dmenu"};
 #ifdef XINERAMA
     XineramaScreenInfo *info;
     Window pw;
-    int a, di, n, area = 0;
+    int a, di, j, n, area = 0;
 #endif
-    /* init appearance */
-    for (j = 0; j < SchemeLast; j++)
-        scheme[j] = drw_scm_create(drw, colors[j], alphas[j], 2);
-
     clip = XInternAtom(dpy, "CLIPBOARD", False);
     utf8 = XInternAtom(dpy, "UTF8_STRING", False);
 
@@ -810,6 +1711,8 @@ static void setup(void) {
     lines = MAX(lines, 0);
     mh = (lines + 1) * bh;
     promptw = (prompt && *prompt) ? TEXTW(prompt) - lrpad / 4 : 0;
+    larroww = TEXTW("<");
+    rarroww = TEXTW(">");
 #ifdef XINERAMA
     i = 0;
     if (parentwin == root && (info = XineramaQueryScreens(dpy, &n))) {
@@ -851,7 +1754,7 @@ static void setup(void) {
 #endif
     {
         if (!XGetWindowAttributes(dpy, parentwin, &wa))
-            die("could not get embedding window attributes: 0x%lx", parentwin);
+            fail("could not get embedding window attributes: 0x%lx", parentwin);
 
         if (centered) {
             mw = MIN(MAX(max_textw() + promptw, min_width), wa.width);
@@ -892,8 +1795,8 @@ static void setup(void) {
     XSetClassHint(dpy, win, &ch);
 
     /* input methods */
-    if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-        die("XOpenIM failed: could not open input device");
+    if (!xim && (xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
+        fail("XOpenIM failed: could not open input device");
 
     xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, win, XNFocusWindow, win, NULL);
 
@@ -912,11 +1815,12 @@ static void setup(void) {
 }
 
 static void usage(void) {
-    fputs("usage: dmenu [-bfcivx] [-p prompt] [-fn font] [-h height]\n"
+    fputs("usage: dmenu [-bfcisvxz] [-p prompt] [-fn font] [-h height]\n"
           "             [-l lines] [-g columns]\n"
           "             [-nb color] [-nf color] [-sb color] [-sf color]\n"
           "             [-w windowid] [-m monitor]\n"
-          "             [-o opacity]\n"
+          "             [-o opacity] [-sync] [-F file] [-H histfile]\n"
+          "             [-client | -daemon]\n"
           "\n"
           "man dmenu for more details\n",
         stderr);
@@ -945,9 +1849,8 @@ unsigned int getpositiveint(char const *flag, char const *value) {
     return (unsigned)out;
 }
 
-int main(int argc, char *argv[]) {
-    XWindowAttributes wa;
-    int i, fast = 0;
+static void parseargs(int argc, char *argv[]) {
+    int i;
 
     for (i = 1; i < argc; i++)
         /* these options take no arguments */
@@ -960,11 +1863,20 @@ int main(int argc, char *argv[]) {
             fast = 1;
         else if (!strcmp(argv[i], "-c")) /* centers dmenu on screen */
             centered = 1;
-        else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
-            fstrncmp = strncasecmp;
-            fstrstr = cistrstr;
-        } else if (!strcmp(argv[i], "-x")) /* invert use_prefix */
+        else if (!strcmp(argv[i], "-s")) /* shows the menu while stdin is still read */
+            streaming = 1;
+        else if (!strcmp(argv[i], "-i")) /* case-insensitive item matching */
+            icase = 1;
+        else if (!strcmp(argv[i], "-x")) /* invert use_prefix */
             use_prefix = !use_prefix;
+        else if (!strcmp(argv[i], "-z")) /* fuzzy matching */
+            fuzzy = 1;
+        else if (!strcmp(argv[i], "-sync")) /* synchronous X requests */
+            syncx = 1;
+        else if (!strcmp(argv[i], "-client")) /* runs in a daemon, if one is listening */
+            client = 1;
+        else if (!strcmp(argv[i], "-daemon")) /* runs the menus of clients */
+            serving = 1;
         else if (i + 1 == argc)
             usage();
         /* these options take one argument */
@@ -1010,16 +1922,136 @@ int main(int argc, char *argv[]) {
             char const *flag = argv[i++];
             char const *value = argv[i];
             border_width = getpositiveint(flag, value);
-        } else if (!strcmp(argv[i], "-it")) { /* items */
+        } else if (!strcmp(argv[i], "-F")) /* reads items from a file */
+            infile = argv[++i];
+        else if (!strcmp(argv[i], "-H")) /* ranks items by a history of selections */
+            histfile = argv[++i];
+        else if (!strcmp(argv[i], "-it")) { /* items */
             argv_items = &argv[++i];
             break;
         } else
             usage();
+}
 
+/* read the items and run the menu until it ends */
+static void menu(void) {
+    if (histfile)
+        history = history_load(histfile);
+    if (streaming && !argv_items) {
+        grabkeyboard();
+    } else if (fast && !isatty(0)) {
+        streaming = 0;
+        grabkeyboard();
+        readinput();
+    } else {
+        streaming = 0;
+        readinput();
+        grabkeyboard();
+    }
+    setup();
+    run();
+}
+
+/* use the fonts and colors a client asked for instead of those of the daemon */
+static void loadlook(void) {
+    if (optionchanged(&fonts)) {
+        daemonfonts = drw->fonts;
+        if (drw_fontset_create(drw, fonts, LENGTH(fonts)))
+            lrpad = drw->fonts->h;
+        else {
+            drw_setfontset(drw, daemonfonts);
+            daemonfonts = NULL;
+        }
+    }
+    if (optionchanged(&colors) || optionchanged(&alphas)) {
+        memcpy(daemonscheme, scheme, sizeof scheme);
+        loadschemes();
+    }
+}
+
+/* the window of a menu embedded into a window that is gone is gone as well */
+static int xerror(Display *d, XErrorEvent *ee) {
+    if (ee->error_code == BadWindow)
+        return 0;
+    return xerrorxlib(d, ee);
+}
+
+/* run the menu of a client with its arguments args, in its working directory
+ * args[0] and with its stdin, stdout and stderr io, and return its status */
+static int servemenu(char **args, int io[3]) {
+    int i, status;
+
+    if ((status = setjmp(menuend)))
+        return status - 1;
+    for (i = 0; args[i]; i++)
+        ;
+    restoreoptions();
+    parseargs(i, args);
+    if (chdir(args[0]) < 0)
+        return 1;
+    for (i = 0; i < 3; i++)
+        if (dup2(io[i], i) < 0)
+            return 1;
+    loadlook();
+    if (!embed || !(parentwin = strtol(embed, NULL, 0)))
+        parentwin = root;
+    menu();
+    return 1; /* unreachable */
+}
+
+/* Run the menus of clients one after another, keeping the connection to the
+ * X server, the fonts and the colors between them, so that a menu only costs
+ * reading its items, mapping its window and drawing it. The options of the
+ * daemon are the defaults of every menu. */
+static void serve(void) {
+    int fd = server_listen(server_path()), conn, io[3], saved[3], status, i;
+    char **args;
+
+    signal(SIGPIPE, SIG_IGN); /* a client going away must not end the daemon */
+    xerrorxlib = XSetErrorHandler(xerror);
+    saveoptions();
+    for (i = 0; i < 3; i++)
+        if ((saved[i] = dup(i)) < 0)
+            die("dup:");
+    for (;;) {
+        if ((conn = server_accept(fd, io, &args)) < 0)
+            continue;
+        status = servemenu(args, io);
+        fflush(stdout);
+        clearerr(stdout);
+        for (i = 0; i < 3; i++) {
+            dup2(saved[i], i);
+            close(io[i]);
+        }
+        server_reply(conn, status);
+        free(args[0]);
+        free(args);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    XWindowAttributes wa;
+    int fd, status;
+
+    parseargs(argc, argv);
+
+    if (infile && !argv_items) {
+        /* read like stdin, so that a regular file gets mapped */
+        if ((fd = open(infile, O_RDONLY)) < 0 || dup2(fd, STDIN_FILENO) < 0)
+            die("cannot open %s:", infile);
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    if (client && (status = server_call(server_path(), argc, argv)) >= 0)
+        return status;
+
+    search_init();
     if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
         fputs("warning: no locale support\n", stderr);
     if (!(dpy = XOpenDisplay(NULL)))
         die("cannot open display");
+    if (syncx)
+        XSynchronize(dpy, True);
     screen = DefaultScreen(dpy);
     root = RootWindow(dpy, screen);
     if (!embed || !(parentwin = strtol(embed, NULL, 0)))
@@ -1031,21 +2063,18 @@ int main(int argc, char *argv[]) {
     if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
         die("no fonts could be loaded.");
     lrpad = drw->fonts->h;
+    loadschemes();
 
 #ifdef __OpenBSD__
-    if (pledge("stdio rpath", NULL) == -1)
+    /* the history is appended to and compacted through a renamed file */
+    if (pledge(serving ? "stdio rpath wpath cpath unix recvfd" : histfile ? "stdio rpath wpath cpath" : "stdio rpath",
+            NULL) == -1)
         die("pledge");
 #endif
 
-    if (fast && !isatty(0)) {
-        grabkeyboard();
-        readinput();
-    } else {
-        readinput();
-        grabkeyboard();
-    }
-    setup();
-    run();
+    if (serving)
+        serve();
+    menu();
 
     return 1; /* unreachable */
 }
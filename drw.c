@@ -11,12 +11,15 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define EXTCACHE    1024 /* text extents cached per font */
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80, 0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const long utfmin[UTF_SIZ + 1] = {0, 0, 0x80, 0x800, 0x10000};
 static const long utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
 
+static Fnt nofont; /* cached for codepoints no font covers */
+
 static long utf8decodebyte(const char c, size_t *i) {
     for (*i = 0; *i < (UTF_SIZ + 1); ++(*i))
         if (((unsigned char)c & utfmask[*i]) == utfbyte[*i])
@@ -67,6 +70,7 @@ Drw *drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned
     drw->depth = depth;
     drw->cmap = cmap;
     drw->drawable = XCreatePixmap(dpy, root, w, h, depth);
+    drw->xftdraw = XftDrawCreate(dpy, drw->drawable, visual, cmap);
     drw->gc = XCreateGC(dpy, drw->drawable, 0, NULL);
     XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -82,12 +86,27 @@ void drw_resize(Drw *drw, unsigned int w, unsigned int h) {
     if (drw->drawable)
         XFreePixmap(drw->dpy, drw->drawable);
     drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+    XftDrawChange(drw->xftdraw, drw->drawable);
+}
+
+static void fontcache_clear(Drw *drw) {
+    size_t i;
+
+    for (i = 0; i < sizeof drw->bmpfonts / sizeof *drw->bmpfonts; i++) {
+        free(drw->bmpfonts[i]);
+        drw->bmpfonts[i] = NULL;
+    }
+    free(drw->cpfonts);
+    drw->cpfonts = NULL;
+    drw->ncpfonts = drw->cpfontsize = 0;
 }
 
 void drw_free(Drw *drw) {
+    XftDrawDestroy(drw->xftdraw);
     XFreePixmap(drw->dpy, drw->drawable);
     XFreeGC(drw->dpy, drw->gc);
     drw_fontset_free(drw->fonts);
+    fontcache_clear(drw);
     free(drw);
 }
 
@@ -146,10 +165,15 @@ static Fnt *xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 }
 
 static void xfont_free(Fnt *font) {
+    size_t i;
+
     if (!font)
         return;
     if (font->pattern)
         FcPatternDestroy(font->pattern);
+    for (i = 0; font->exts && i < EXTCACHE; i++)
+        free(font->exts[i].text);
+    free(font->exts);
     XftFontClose(font->dpy, font->xfont);
     free(font);
 }
@@ -167,6 +191,7 @@ Fnt *drw_fontset_create(Drw *drw, const char *fonts[], size_t fontcount) {
             ret = cur;
         }
     }
+    fontcache_clear(drw);
     return (drw->fonts = ret);
 }
 
@@ -203,8 +228,10 @@ Clr *drw_scm_create(Drw *drw, const char *clrnames[], const unsigned int alphas[
 }
 
 void drw_setfontset(Drw *drw, Fnt *set) {
-    if (drw)
+    if (drw && drw->fonts != set) {
+        fontcache_clear(drw);
         drw->fonts = set;
+    }
 }
 
 void drw_setscheme(Drw *drw, Clr *scm) {
@@ -222,21 +249,118 @@ void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled
         XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+/* Return the cache slot for the font of codepoint cp. */
+static Fnt **fontslot(Drw *drw, long cp) {
+    Cpfont *old;
+    size_t i, j, oldsize, mask;
+
+    if (cp < 0x10000) {
+        if (!drw->bmpfonts[cp >> 8])
+            drw->bmpfonts[cp >> 8] = ecalloc(256, sizeof(Fnt *));
+        return &drw->bmpfonts[cp >> 8][cp & 0xff];
+    }
+    /* open addressing; cp is never 0 here, so 0 marks a free entry */
+    if (2 * (drw->ncpfonts + 1) > drw->cpfontsize) {
+        old = drw->cpfonts;
+        oldsize = drw->cpfontsize;
+        drw->cpfontsize = MAX(64, oldsize * 2);
+        drw->cpfonts = ecalloc(drw->cpfontsize, sizeof(Cpfont));
+        for (mask = drw->cpfontsize - 1, i = 0; i < oldsize; i++) {
+            if (!old[i].cp)
+                continue;
+            for (j = (old[i].cp * 2654435761UL) & mask; drw->cpfonts[j].cp; j = (j + 1) & mask)
+                ;
+            drw->cpfonts[j] = old[i];
+        }
+        free(old);
+    }
+    mask = drw->cpfontsize - 1;
+    for (i = (cp * 2654435761UL) & mask; drw->cpfonts[i].cp && drw->cpfonts[i].cp != cp; i = (i + 1) & mask)
+        ;
+    if (!drw->cpfonts[i].cp) {
+        drw->cpfonts[i].cp = cp;
+        drw->ncpfonts++;
+    }
+    return &drw->cpfonts[i].font;
+}
+
+/* Ask fontconfig for a font covering codepoint cp and append it to the
+ * fontset. Returns NULL if there is none. */
+static Fnt *xfont_fallback(Drw *drw, long cp) {
+    Fnt *font, *curfont;
+    FcCharSet *fccharset;
+    FcPattern *fcpattern;
+    FcPattern *match;
+    XftResult result;
+
+    fccharset = FcCharSetCreate();
+    FcCharSetAddChar(fccharset, cp);
+
+    if (!drw->fonts->pattern) {
+        /* Refer to the comment in xfont_create for more information. */
+        die("the first font in the cache must be loaded from a font string.");
+    }
+
+    fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+    FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+    FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+    FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+    FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+    FcDefaultSubstitute(fcpattern);
+    match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+    FcCharSetDestroy(fccharset);
+    FcPatternDestroy(fcpattern);
+
+    if (!match)
+        return NULL;
+    font = xfont_create(drw, NULL, match);
+    if (!font || !XftCharExists(drw->dpy, font->xfont, cp)) {
+        xfont_free(font);
+        return NULL;
+    }
+    for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+        ; /* NOP */
+    curfont->next = font;
+    /* codepoints cached as not covered may be covered by the new font */
+    fontcache_clear(drw);
+    return font;
+}
+
+/* Return the first font of the fontset covering codepoint cp, loading a
+ * fallback font if necessary. Codepoints no font covers are drawn with the
+ * first font. The answer is cached, so fontconfig is asked only once. */
+static Fnt *xfont_find(Drw *drw, long cp) {
+    Fnt *font = *fontslot(drw, cp);
+
+    if (font)
+        return font == &nofont ? drw->fonts : font;
+    for (font = drw->fonts; font && !XftCharExists(drw->dpy, font->xfont, cp); font = font->next)
+        ;
+    if (!font)
+        font = xfont_fallback(drw, cp);
+    *fontslot(drw, cp) = font ? font : &nofont;
+    return font ? font : drw->fonts;
+}
+
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert) {
+    return drw_textn(drw, x, y, w, h, lpad, text, text ? strlen(text) : 0, invert);
+}
+
+/* Like drw_text, for the textlen bytes at text, which need not be NUL-terminated. */
+int drw_textn(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, size_t textlen, int invert) {
     char buf[1024];
-    int ty;
+    XftGlyphFontSpec specs[sizeof buf];
+    XGlyphInfo ext;
+    FT_UInt glyph;
+    int ty, gx;
     unsigned int ew;
-    XftDraw *d = NULL;
-    Fnt *usedfont, *curfont, *nextfont;
-    size_t i, len;
+    Fnt *usedfont, *nextfont;
+    size_t i, n, len, nspecs = 0;
     int utf8strlen, utf8charlen, render = x || y || w || h;
     long utf8codepoint = 0;
-    const char *utf8str;
-    FcCharSet *fccharset;
-    FcPattern *fcpattern;
-    FcPattern *match;
-    XftResult result;
-    int charexists = 0;
+    const char *utf8str, *end = text + textlen;
 
     if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
         return 0;
@@ -246,42 +370,38 @@ int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned in
     } else {
         XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
         XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-        d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
         x += lpad;
         w -= lpad;
     }
 
     usedfont = drw->fonts;
     while (1) {
+        /* take the longest run of characters drawn with the same font */
         utf8strlen = 0;
         utf8str = text;
-        nextfont = NULL;
-        while (*text) {
-            utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-            for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-                charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-                if (charexists) {
-                    if (curfont == usedfont) {
-                        utf8strlen += utf8charlen;
-                        text += utf8charlen;
-                    } else {
-                        nextfont = curfont;
-                    }
-                    break;
-                }
-            }
-
-            if (!charexists || nextfont)
+        nextfont = usedfont;
+        while (text < end) {
+            /* a character cut off at the end is taken as one invalid byte */
+            utf8charlen = MAX(1, utf8decode(text, &utf8codepoint, MIN(UTF_SIZ, end - text)));
+            if ((nextfont = xfont_find(drw, utf8codepoint)) != usedfont)
                 break;
-            else
-                charexists = 0;
+            utf8strlen += utf8charlen;
+            text += utf8charlen;
         }
 
         if (utf8strlen) {
             drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-            /* shorten text if necessary */
-            for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-                drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+            len = utf8strlen;
+            /* shorten text if necessary, to the characters that fit by their
+             * advances, in one pass rather than measuring every prefix */
+            if (ew > w || len > sizeof(buf) - 1)
+                for (len = 0, ew = 0; len < (size_t)utf8strlen; len += n, ew += ext.xOff) {
+                    n = MAX(1, utf8decode(utf8str + len, &utf8codepoint, MIN(UTF_SIZ, utf8strlen - len)));
+                    glyph = XftCharIndex(drw->dpy, usedfont->xfont, utf8codepoint);
+                    XftGlyphExtents(drw->dpy, usedfont->xfont, &glyph, 1, &ext);
+                    if (len + n > sizeof(buf) - 1 || ew + ext.xOff > w)
+                        break;
+                }
 
             if (len) {
                 memcpy(buf, utf8str, len);
@@ -291,59 +411,33 @@ int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned in
                         ; /* NOP */
 
                 if (render) {
+                    /* collect the glyphs of all runs to draw them at once */
                     ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-                    XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg], usedfont->xfont, x, ty, (XftChar8 *)buf, len);
+                    for (i = 0, gx = x; i < len && (n = utf8decode(buf + i, &utf8codepoint, len - i)); i += n) {
+                        if (nspecs == sizeof specs / sizeof *specs) {
+                            XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg], specs, nspecs);
+                            nspecs = 0;
+                        }
+                        specs[nspecs].font = usedfont->xfont;
+                        specs[nspecs].glyph = XftCharIndex(drw->dpy, usedfont->xfont, utf8codepoint);
+                        specs[nspecs].x = gx;
+                        specs[nspecs].y = ty;
+                        XftGlyphExtents(drw->dpy, usedfont->xfont, &specs[nspecs].glyph, 1, &ext);
+                        gx += ext.xOff;
+                        nspecs++;
+                    }
                 }
                 x += ew;
                 w -= ew;
             }
         }
 
-        if (!*text) {
+        if (text >= end)
             break;
-        } else if (nextfont) {
-            charexists = 0;
-            usedfont = nextfont;
-        } else {
-            /* Regardless of whether or not a fallback font is found, the
-             * character must be drawn. */
-            charexists = 1;
-
-            fccharset = FcCharSetCreate();
-            FcCharSetAddChar(fccharset, utf8codepoint);
-
-            if (!drw->fonts->pattern) {
-                /* Refer to the comment in xfont_create for more information. */
-                die("the first font in the cache must be loaded from a font string.");
-            }
-
-            fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-            FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-            FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-            FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-            FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-            FcDefaultSubstitute(fcpattern);
-            match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-            FcCharSetDestroy(fccharset);
-            FcPatternDestroy(fcpattern);
-
-            if (match) {
-                usedfont = xfont_create(drw, NULL, match);
-                if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-                    for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-                        ; /* NOP */
-                    curfont->next = usedfont;
-                } else {
-                    xfont_free(usedfont);
-                    usedfont = drw->fonts;
-                }
-            }
-        }
+        usedfont = nextfont;
     }
-    if (d)
-        XftDrawDestroy(d);
+    if (nspecs)
+        XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg], specs, nspecs);
 
     return x + (render ? w : 0);
 }
@@ -352,25 +446,79 @@ void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
     if (!drw)
         return;
 
+    /* only flush, waiting for the server would cost a round-trip per frame;
+     * errors are still reported, just asynchronously */
     XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-    XSync(drw->dpy, False);
+    XFlush(drw->dpy);
+}
+
+/* Store in adv[i] the width of the first i bytes of text, for i from 0 to len,
+ * in one pass over its glyphs; offsets inside a character get the width of the
+ * text before it. */
+void drw_fontset_getadvances(Drw *drw, const char *text, size_t len, unsigned int *adv) {
+    size_t i = 0, j, n;
+    unsigned int w = 0;
+    long cp;
+    Fnt *font;
+    FT_UInt glyph;
+    XGlyphInfo ext;
+
+    if (drw && drw->fonts && text) {
+        for (; i < len && (n = utf8decode(text + i, &cp, MIN(UTF_SIZ, len - i))); i += n) {
+            font = xfont_find(drw, cp);
+            glyph = XftCharIndex(drw->dpy, font->xfont, cp);
+            XftGlyphExtents(drw->dpy, font->xfont, &glyph, 1, &ext);
+            for (j = 0; j < n; j++)
+                adv[i + j] = w;
+            w += ext.xOff;
+        }
+    }
+    for (; i <= len; i++)
+        adv[i] = w;
 }
 
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text) {
+    return drw_fontset_getwidthn(drw, text, text ? strlen(text) : 0);
+}
+
+unsigned int drw_fontset_getwidthn(Drw *drw, const char *text, size_t len) {
     if (!drw || !drw->fonts || !text)
         return 0;
-    return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+    return drw_textn(drw, 0, 0, 0, 0, 0, text, len, 0);
+}
+
+static unsigned long hashtext(const char *text, unsigned int len) {
+    unsigned long hash = 2166136261UL;
+
+    while (len--)
+        hash = (hash ^ (unsigned char)*text++) * 16777619UL;
+    return hash;
 }
 
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h) {
     XGlyphInfo ext;
+    unsigned long hash;
+    Ext *e;
 
     if (!font || !text)
         return;
 
-    XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+    /* a direct-mapped cache, an entry is replaced by the next text hashed to it */
+    if (!font->exts)
+        font->exts = ecalloc(EXTCACHE, sizeof(Ext));
+    hash = hashtext(text, len);
+    e = &font->exts[hash % EXTCACHE];
+    if (!e->text || e->hash != hash || e->len != len || memcmp(e->text, text, len)) {
+        XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+        if (!(e->text = realloc(e->text, MAX(len, 1))))
+            die("cannot realloc %u bytes:", MAX(len, 1));
+        memcpy(e->text, text, len);
+        e->len = len;
+        e->hash = hash;
+        e->w = ext.xOff;
+    }
     if (w)
-        *w = ext.xOff;
+        *w = e->w;
     if (h)
         *h = font->h;
 }
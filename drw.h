@@ -12,14 +12,26 @@ typedef struct {
     Cursor cursor;
 } Cur;
 
+typedef struct {
+    char *text;
+    unsigned int len, w;
+    unsigned long hash;
+} Ext;
+
 typedef struct Fnt {
     Display *dpy;
     unsigned int h;
     XftFont *xfont;
     FcPattern *pattern;
+    Ext *exts; /* cache of text extents */
     struct Fnt *next;
 } Fnt;
 
+typedef struct {
+    long cp;
+    Fnt *font;
+} Cpfont;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
@@ -32,9 +44,13 @@ typedef struct {
     unsigned int depth;
     Colormap cmap;
     Drawable drawable;
+    XftDraw *xftdraw; /* bound to drawable */
     GC gc;
     Clr *scheme;
     Fnt *fonts;
+    Fnt **bmpfonts[256];  /* font of each BMP codepoint, in pages of 256 */
+    Cpfont *cpfonts;      /* font of the other codepoints, hashed */
+    size_t ncpfonts, cpfontsize;
 } Drw;
 
 /* Drawable abstraction */
@@ -46,6 +62,8 @@ void drw_free(Drw *drw);
 Fnt *drw_fontset_create(Drw *drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt *set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+unsigned int drw_fontset_getwidthn(Drw *drw, const char *text, size_t len);
+void drw_fontset_getadvances(Drw *drw, const char *text, size_t len, unsigned int *adv);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
@@ -63,6 +81,7 @@ void drw_setscheme(Drw *drw, Clr *scm);
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
+int drw_textn(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, size_t textlen, int invert);
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
@@ -0,0 +1,106 @@
+/* See LICENSE file for copyright and license details. */
+#include "fuzzy.h"
+
+#include <string.h>
+
+/* scoring, modelled on fzf: every matched character scores, gaps cost, and
+ * characters at word boundaries or continuing a run of matches earn a bonus */
+#define SCOREMATCH       16
+#define SCOREGAPSTART    -3
+#define SCOREGAPEXTEND   -1
+#define BONUSBOUNDARY    8
+#define BONUSCAMEL       7
+#define BONUSCONSECUTIVE 4
+#define BONUSFIRSTMULT   2 /* the bonus of the first pattern character counts double */
+
+static size_t charlen(const char *s, size_t len) {
+    unsigned char c = *s;
+    size_t n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+
+    return n > len ? 1 : n;
+}
+
+static int isdelim(char c) {
+    return strchr(" /\\_-.,:;|()[]{}<>'\"", c) != NULL;
+}
+
+/* bonus for a match at offset i of text, based on the character before it */
+static int bonus(const char *text, size_t i) {
+    char prev, cur = text[i];
+
+    if (i == 0)
+        return BONUSBOUNDARY;
+    prev = text[i - 1];
+    if (isdelim(prev) && !isdelim(cur))
+        return BONUSBOUNDARY;
+    if ((prev >= 'a' && prev <= 'z' && cur >= 'A' && cur <= 'Z') ||
+        (!(prev >= '0' && prev <= '9') && cur >= '0' && cur <= '9'))
+        return BONUSCAMEL;
+    return 0;
+}
+
+/* Find pat as a subsequence of the len bytes of s, comparing whole UTF-8
+ * characters. text is the item as displayed (s may be its case-folded copy)
+ * and is only used to find word boundaries. Returns 0 if there is no match.
+ * Otherwise, if score is NULL, returns 1. Else the match is shrunk to the
+ * shortest window ending at the first possible end and scored, the byte
+ * offsets of the matched characters are stored in pos unless it is NULL (it
+ * must hold plen entries) and their number is returned. */
+int fuzzy_match(const char *text, const char *s, size_t len, const char *pat, size_t plen, int *score, size_t *pos) {
+    size_t i, j, n, m, start, end;
+    int sc, b, runbonus, inrun, npos;
+
+    /* forward: find the first end of a match */
+    for (i = 0, j = 0; i < len && j < plen; i += n) {
+        n = charlen(s + i, len - i);
+        m = charlen(pat + j, plen - j);
+        if (n == m && !memcmp(s + i, pat + j, n))
+            j += m;
+    }
+    if (j < plen)
+        return 0;
+    if (!score)
+        return 1;
+
+    /* backward: find the last start of a match ending there */
+    end = i;
+    for (start = end, j = plen; j > 0 && start > 0;) {
+        for (m = 1; m < j && (pat[j - m] & 0xc0) == 0x80; m++)
+            ;
+        for (n = 1; n < start && (s[start - n] & 0xc0) == 0x80; n++)
+            ;
+        start -= n;
+        if (n == m && !memcmp(s + start, pat + j - m, m))
+            j -= m;
+    }
+
+    /* score the greedy match inside the window */
+    sc = 0;
+    npos = 0;
+    inrun = 0;
+    runbonus = 0;
+    for (i = start, j = 0; i < end; i += n) {
+        n = charlen(s + i, end - i);
+        m = j < plen ? charlen(pat + j, plen - j) : 0;
+        if (j < plen && n == m && !memcmp(s + i, pat + j, n)) {
+            b = bonus(text, i);
+            if (inrun) {
+                /* a run keeps the best bonus it started with */
+                runbonus = b = b > runbonus ? b : runbonus;
+                b = b > BONUSCONSECUTIVE ? b : BONUSCONSECUTIVE;
+            } else
+                runbonus = b;
+            sc += SCOREMATCH + (j == 0 ? b * BONUSFIRSTMULT : b);
+            if (pos)
+                pos[npos] = i;
+            npos++;
+            inrun = 1;
+            j += m;
+        } else {
+            sc += inrun ? SCOREGAPSTART : SCOREGAPEXTEND;
+            inrun = 0;
+        }
+    }
+    *score = sc;
+    return npos;
+}
@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef FUZZY_H
+#define FUZZY_H
+#include <stddef.h>
+
+/* Fuzzy matching abstraction */
+int fuzzy_match(const char *text, const char *s, size_t len, const char *pat, size_t plen, int *score, size_t *pos);
+
+#endif  // FUZZY_H
@@ -0,0 +1,183 @@
+/* See LICENSE file for copyright and license details. */
+#include "history.h"
+
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HALFLIFE     (7 * 24 * 3600.0) /* seconds after which a selection counts half */
+#define MINSCORE     0.01              /* texts scoring less are forgotten on compaction */
+#define COMPACTSLACK 256               /* records appended beyond two per text before compaction */
+
+/* The history file holds one record per line: a time in seconds since the
+ * epoch, a weight and a selected text. A selection appends a record of weight
+ * 1, and compaction replaces all records of a text by one weighted with its
+ * score. The score of a text is the sum of the weights of its records, halved
+ * for every HALFLIFE since they were written, so it accounts for both how
+ * often and how recently it was selected. */
+
+typedef struct {
+    char *text; /* NULL if the slot is free */
+    size_t len;
+    unsigned long hash;
+    double score; /* as of History.now */
+} Entry;
+
+struct History {
+    const char *path;
+    time_t now;
+    Entry *entries; /* open addressing with linear probing */
+    size_t n, size; /* size is a power of two */
+    size_t nrecords; /* records in the file */
+};
+
+static unsigned long hash(const char *s, size_t len) {
+    unsigned long h = 2166136261UL;
+
+    while (len--)
+        h = (h ^ (unsigned char)*s++) * 16777619UL;
+    return h;
+}
+
+/* the entry of s, or the free slot where it belongs */
+static Entry *lookup(const History *h, const char *s, size_t len, unsigned long hv) {
+    size_t i;
+    Entry *e;
+
+    for (i = hv & (h->size - 1); (e = &h->entries[i])->text; i = (i + 1) & (h->size - 1))
+        if (e->hash == hv && e->len == len && !memcmp(e->text, s, len))
+            break;
+    return e;
+}
+
+static void add(History *h, const char *s, size_t len, double score) {
+    Entry *old = h->entries, *e;
+    size_t i, oldsize = h->size;
+    unsigned long hv = hash(s, len);
+
+    /* keep the table at most half full */
+    if (2 * (h->n + 1) > h->size) {
+        h->size = MAX(64, h->size * 2);
+        h->entries = ecalloc(h->size, sizeof(Entry));
+        for (i = 0; i < oldsize; i++)
+            if (old[i].text)
+                *lookup(h, old[i].text, old[i].len, old[i].hash) = old[i];
+        free(old);
+    }
+    if (!(e = lookup(h, s, len, hv))->text) {
+        e->text = ecalloc(len + 1, 1);
+        memcpy(e->text, s, len);
+        e->len = len;
+        e->hash = hv;
+        h->n++;
+    }
+    e->score += score;
+}
+
+/* rewrite the file with one record per text still worth remembering, through
+ * a temporary file so that it is never left half written */
+static void compact(History *h) {
+    size_t i, n = 0, size = strlen(h->path) + 32;
+    char *tmp = ecalloc(size, 1);
+    FILE *fp;
+    Entry *e;
+
+    snprintf(tmp, size, "%s.%ld", h->path, (long)getpid());
+    if (!(fp = fopen(tmp, "w"))) {
+        free(tmp);
+        return;
+    }
+    for (i = 0; i < h->size; i++) {
+        e = &h->entries[i];
+        if (!e->text || e->score < MINSCORE)
+            continue;
+        fprintf(fp, "%lld %.6g ", (long long)h->now, e->score);
+        fwrite(e->text, 1, e->len, fp);
+        fputc('\n', fp);
+        n++;
+    }
+    if (ferror(fp) | fclose(fp) || rename(tmp, h->path) < 0)
+        unlink(tmp);
+    else
+        h->nrecords = n;
+    free(tmp);
+}
+
+/* Load the history kept in the file at path, which must stay valid as long as
+ * h. A missing or unreadable file is an empty history, and malformed records
+ * are skipped. */
+History *history_load(const char *path) {
+    History *h = ecalloc(1, sizeof(History));
+    char *line = NULL, *s, *t;
+    size_t size = 0;
+    ssize_t n;
+    long long when;
+    double weight;
+    FILE *fp;
+
+    h->path = path;
+    h->now = time(NULL);
+    h->size = 64;
+    h->entries = ecalloc(h->size, sizeof(Entry));
+    if (!(fp = fopen(path, "r")))
+        return h;
+    while ((n = getline(&line, &size, fp)) > 0) {
+        if (line[n - 1] == '\n')
+            line[--n] = '\0';
+        when = strtoll(line, &s, 10);
+        if (s == line || *s != ' ')
+            continue;
+        weight = strtod(s + 1, &t);
+        if (t == s + 1 || *t != ' ' || !t[1])
+            continue;
+        t++;
+        add(h, t, line + n - t, weight * exp2((MIN(when, (long long)h->now) - h->now) / HALFLIFE));
+        h->nrecords++;
+    }
+    free(line);
+    fclose(fp);
+    return h;
+}
+
+void history_free(History *h) {
+    size_t i;
+
+    if (!h)
+        return;
+    for (i = 0; i < h->size; i++)
+        free(h->entries[i].text);
+    free(h->entries);
+    free(h);
+}
+
+/* the score of the len bytes of s, 0 if they were never selected */
+double history_score(const History *h, const char *s, size_t len) {
+    return lookup(h, s, len, hash(s, len))->score;
+}
+
+/* Record a selection of the len bytes of s by appending it to the file, or by
+ * compacting the file once it holds too many records. The history is only a
+ * convenience, so failing to write it is not an error. */
+void history_add(History *h, const char *s, size_t len) {
+    FILE *fp;
+
+    if (!len || memchr(s, '\n', len))
+        return;
+    add(h, s, len, 1);
+    if (h->nrecords + 1 > 2 * h->n + COMPACTSLACK) {
+        compact(h);
+        return;
+    }
+    if (!(fp = fopen(h->path, "a")))
+        return;
+    fprintf(fp, "%lld 1 ", (long long)time(NULL));
+    fwrite(s, 1, len, fp);
+    fputc('\n', fp);
+    if (!(ferror(fp) | fclose(fp)))
+        h->nrecords++;
+}
@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <stddef.h>
+
+/* History abstraction */
+typedef struct History History;
+
+History *history_load(const char *path);
+void history_free(History *h);
+double history_score(const History *h, const char *s, size_t len);
+void history_add(History *h, const char *s, size_t len);
+
+#endif  // HISTORY_H
@@ -0,0 +1,84 @@
+/* See LICENSE file for copyright and license details. */
+#include "pool.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAXWORKERS 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finish = PTHREAD_COND_INITIALIZER;
+static size_t nworkers = (size_t)-1;
+
+/* the job currently being run, guarded by lock */
+static void (*jobfn)(size_t, void *);
+static void *jobarg;
+static size_t jobshards, nextshard, doneshards;
+static unsigned long generation;
+
+/* take shards of the current job until none are left; called with lock held */
+static void work(void) {
+    size_t shard;
+
+    while (nextshard < jobshards) {
+        shard = nextshard++;
+        pthread_mutex_unlock(&lock);
+        jobfn(shard, jobarg);
+        pthread_mutex_lock(&lock);
+        if (++doneshards == jobshards)
+            pthread_cond_signal(&finish);
+    }
+}
+
+static void *worker(void *unused) {
+    unsigned long seen = 0;
+
+    (void)unused;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen)
+            pthread_cond_wait(&start, &lock);
+        seen = generation;
+        work();
+    }
+    return NULL;
+}
+
+/* Number of threads running shards, including the caller of pool_run. The
+ * workers are started on first use. */
+size_t pool_size(void) {
+    pthread_t tid;
+    long ncpu;
+
+    if (nworkers != (size_t)-1)
+        return nworkers + 1;
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (nworkers = 0; (long)nworkers + 1 < ncpu && nworkers < MAXWORKERS; nworkers++)
+        if (pthread_create(&tid, NULL, worker, NULL) || pthread_detach(tid))
+            break;
+    return nworkers + 1;
+}
+
+/* Call fn for every shard in [0, nshards) spread over the pool, and return
+ * once all of them are done. The calling thread runs shards as well. */
+void pool_run(size_t nshards, void (*fn)(size_t shard, void *arg), void *arg) {
+    size_t i;
+
+    if (nshards <= 1 || pool_size() == 1) {
+        for (i = 0; i < nshards; i++)
+            fn(i, arg);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    jobfn = fn;
+    jobarg = arg;
+    jobshards = nshards;
+    nextshard = doneshards = 0;
+    generation++;
+    pthread_cond_broadcast(&start);
+    work();
+    while (doneshards < jobshards)
+        pthread_cond_wait(&finish, &lock);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,10 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+/* Worker pool abstraction */
+size_t pool_size(void);
+void pool_run(size_t nshards, void (*fn)(size_t shard, void *arg), void *arg);
+
+#endif  // POOL_H
@@ -0,0 +1,135 @@
+/* See LICENSE file for copyright and license details. */
+#include "search.h"
+
+#include <string.h>
+#include <wctype.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef char *(*Searchfn)(const char *s, size_t slen, const char *sub, size_t sublen);
+
+/* The scalar kernels are also used for the tail of the vectorised ones, which
+ * never read past s + slen. */
+static char *scalarfind(const char *s, size_t slen, const char *sub, size_t sublen) {
+    const char *p, *end;
+
+    if (sublen > slen)
+        return NULL;
+    for (p = s, end = s + slen - sublen; p <= end && (p = memchr(p, *sub, end - p + 1)); p++)
+        if (!memcmp(p + 1, sub + 1, sublen - 1))
+            return (char *)p;
+    return NULL;
+}
+
+#ifdef SEARCH_X86
+/* Compare the first and the last byte of sub against 16 (or 32) positions at
+ * once, and only verify the positions where both of them are found. See
+ * http://0x80.pl/articles/simd-strfind.html */
+
+__attribute__((target("sse2"))) static char *sse2find(const char *s, size_t slen, const char *sub, size_t sublen) {
+    const __m128i first = _mm_set1_epi8(sub[0]), last = _mm_set1_epi8(sub[sublen - 1]);
+    size_t i;
+    unsigned int mask;
+    int bit;
+
+    for (i = 0; i + sublen - 1 + 16 <= slen; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(s + i + sublen - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        for (; mask; mask &= mask - 1) {
+            bit = __builtin_ctz(mask);
+            if (!memcmp(s + i + bit + 1, sub + 1, sublen - 1))
+                return (char *)s + i + bit;
+        }
+    }
+    return scalarfind(s + i, slen - i, sub, sublen);
+}
+
+__attribute__((target("avx2"))) static char *avx2find(const char *s, size_t slen, const char *sub, size_t sublen) {
+    const __m256i first = _mm256_set1_epi8(sub[0]), last = _mm256_set1_epi8(sub[sublen - 1]);
+    size_t i;
+    unsigned int mask;
+    int bit;
+
+    for (i = 0; i + sublen - 1 + 32 <= slen; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(s + i + sublen - 1));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+        for (; mask; mask &= mask - 1) {
+            bit = __builtin_ctz(mask);
+            if (!memcmp(s + i + bit + 1, sub + 1, sublen - 1))
+                return (char *)s + i + bit;
+        }
+    }
+    return sse2find(s + i, slen - i, sub, sublen);
+}
+
+#endif
+
+static Searchfn findfn = scalarfind;
+
+/* pick the widest kernels the CPU supports */
+void search_init(void) {
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findfn = avx2find;
+    else if (__builtin_cpu_supports("sse2"))
+        findfn = sse2find;
+#endif
+}
+
+char *search_find(const char *s, size_t slen, const char *sub, size_t sublen) {
+    if (!sublen)
+        return (char *)s;
+    if (sublen > slen)
+        return NULL;
+    return findfn(s, slen, sub, sublen);
+}
+
+/* Write the lowercase form of the UTF-8 string src to dst, which may be src
+ * itself. A character is only folded when its lowercase form is encoded in as
+ * many bytes, so that byte offsets in dst are also valid in src. Returns
+ * whether anything was folded. */
+int search_fold(char *dst, const char *src, size_t len) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i, j, n;
+    int changed = 0;
+    wint_t c, l;
+
+    for (i = 0; i < len; i += n) {
+        if (s[i] < 0x80) {
+            n = 1;
+            if (s[i] >= 'A' && s[i] <= 'Z') {
+                dst[i] = s[i] | 0x20;
+                changed = 1;
+            } else
+                dst[i] = s[i];
+            continue;
+        }
+        n = s[i] >= 0xf0 ? 4 : s[i] >= 0xe0 ? 3 : s[i] >= 0xc0 ? 2 : 1;
+        if (n == 1 || i + n > len) {
+            dst[i] = s[i];
+            n = 1;
+            continue;
+        }
+        for (c = s[i] & (0x7f >> n), j = 1; j < n && (s[i + j] & 0xc0) == 0x80; j++)
+            c = (c << 6) | (s[i + j] & 0x3f);
+        if (j < n || (l = towlower(c)) == c || (l < 0x80) + (l < 0x800) + (l < 0x10000) != 4 - n) {
+            /* invalid, already lowercase, or its lowercase form has another length */
+            memmove(dst + i, s + i, j);
+            n = j;
+            continue;
+        }
+        for (j = n - 1; j > 0; j--) {
+            dst[i + j] = 0x80 | (l & 0x3f);
+            l >>= 6;
+        }
+        dst[i] = ((0xf0 << (4 - n)) & 0xff) | l;
+        changed = 1;
+    }
+    return changed;
+}
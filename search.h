@@ -0,0 +1,11 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef SEARCH_H
+#define SEARCH_H
+#include <stddef.h>
+
+/* Substring search abstraction; s and sub need not be NUL-terminated */
+void search_init(void);
+char *search_find(const char *s, size_t slen, const char *sub, size_t sublen);
+int search_fold(char *dst, const char *src, size_t len);
+
+#endif  // SEARCH_H
@@ -0,0 +1,285 @@
+/* See LICENSE file for copyright and license details. */
+#ifdef __linux__
+#define _GNU_SOURCE /* struct ucred */
+#endif
+#include "server.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* bytes of a request, about the most a command line and a working directory
+ * can take */
+#define MAXREQUEST  (2 * 1024 * 1024 + PATH_MAX)
+#define READYWAIT   250 /* milliseconds a client waits for the daemon to take it */
+#define REQUESTWAIT 1   /* seconds the daemon waits for the request of a client */
+
+/* The daemon takes a client by sending it one byte. Only then does the client
+ * send a header along with its stdin, stdout and stderr, then its working
+ * directory and its arguments, each terminated by a NUL byte, so that a client
+ * the daemon is too busy to take can still run its menu itself. Once the menu
+ * is done, the daemon answers with one byte, the exit status. */
+struct header {
+    unsigned int nargs; /* arguments after the working directory */
+    unsigned int size;  /* bytes of the working directory and the arguments */
+};
+
+/* control message carrying the stdin, stdout and stderr of a client */
+union fds {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+};
+
+static int readall(int fd, void *buf, size_t n) {
+    ssize_t r;
+
+    for (; n; n -= r, buf = (char *)buf + r)
+        if ((r = read(fd, buf, n)) <= 0 && !(r < 0 && errno == EINTR))
+            return -1;
+        else if (r < 0)
+            r = 0;
+    return 0;
+}
+
+static int writeall(int fd, const void *buf, size_t n) {
+    ssize_t r;
+
+    for (; n; n -= r, buf = (const char *)buf + r)
+        if ((r = send(fd, buf, n, MSG_NOSIGNAL)) < 0 && errno != EINTR)
+            return -1;
+        else if (r < 0)
+            r = 0;
+    return 0;
+}
+
+/* the user id of the process at the other end of the socket fd */
+static int peeruid(int fd, uid_t *uid) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return -1;
+    *uid = cred.uid;
+    return 0;
+#else
+    gid_t gid;
+
+    return getpeereid(fd, uid, &gid);
+#endif
+}
+
+/* Whether the directory of the socket at path is one only the user can enter,
+ * creating it first if create is set. It is not followed if it is a link, so
+ * that nobody else can have a daemon or a client talk to their socket. */
+static int privatedir(const char *path, int create) {
+    char dir[sizeof ((struct sockaddr_un *)0)->sun_path];
+    struct stat st;
+    char *s;
+
+    snprintf(dir, sizeof dir, "%s", path);
+    if (!(s = strrchr(dir, '/')) || s == dir)
+        return 0;
+    *s = '\0';
+    if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return 0;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && !(st.st_mode & 077);
+}
+
+static int dial(const char *path) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof sa.sun_path || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    strcpy(sa.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* the socket of the daemon for $DISPLAY, in $XDG_RUNTIME_DIR or else in a
+ * directory of the user in /tmp */
+const char *server_path(void) {
+    static char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+    const char *dir = getenv("XDG_RUNTIME_DIR"), *display = getenv("DISPLAY");
+    char *s;
+
+    if (dir && *dir)
+        snprintf(path, sizeof path, "%s/dmenu", dir);
+    else
+        snprintf(path, sizeof path, "/tmp/dmenu-%ld/dmenu", (long)getuid());
+    s = path + strlen(path);
+    snprintf(s, sizeof path - (s - path), "%s.sock", display ? display : "");
+    for (; *s; s++)
+        if (*s == '/')
+            *s = '_';
+    return path;
+}
+
+/* Listen on a socket at path, which only the user can connect to. A socket
+ * left over by a daemon that is gone is replaced. */
+int server_listen(const char *path) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof sa.sun_path)
+        die("socket path too long: %s", path);
+    if (!privatedir(path, 1))
+        die("the directory of %s is not private to the user", path);
+    if ((fd = dial(path)) >= 0)
+        die("a daemon is already listening on %s", path);
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die("socket:");
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(fd, 16) < 0)
+        die("cannot listen on %s:", path);
+    umask(mask);
+    return fd;
+}
+
+/* Accept the next client on fd and return the connection, or -1 if it is
+ * another user, gave up waiting or sent a malformed or no request in time. The stdin, stdout and stderr of the client are stored in
+ * io, and its working directory, its arguments and NULL in *args, which is to
+ * be freed by the caller along with (*args)[0]. */
+int server_accept(int fd, int io[3], char ***args) {
+    union fds ctl;
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cm;
+    struct header hdr;
+    struct timeval tv = {.tv_sec = REQUESTWAIT};
+    unsigned int i;
+    unsigned char c = 0;
+    char *buf, *s;
+    uid_t uid;
+    int conn;
+
+    if ((conn = accept(fd, NULL, NULL)) < 0)
+        return -1;
+    if (peeruid(conn, &uid) < 0 || uid != getuid() || setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0 ||
+        writeall(conn, &c, 1) < 0) {
+        close(conn);
+        return -1;
+    }
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof hdr;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    if (recvmsg(conn, &msg, 0) != sizeof hdr || !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_level != SOL_SOCKET ||
+        cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(3 * sizeof *io)) {
+        close(conn);
+        return -1;
+    }
+    memcpy(io, CMSG_DATA(cm), 3 * sizeof *io);
+
+    /* the working directory and each argument take at least a byte */
+    buf = NULL;
+    *args = NULL;
+    if (hdr.size > MAXREQUEST || hdr.nargs >= hdr.size)
+        goto fail;
+    buf = ecalloc(hdr.size + 1, 1);
+    *args = ecalloc(hdr.nargs + 2, sizeof **args);
+    if (readall(conn, buf, hdr.size) < 0)
+        goto fail;
+    for (i = 0, s = buf; i <= hdr.nargs; i++, s += strlen(s) + 1) {
+        if (s >= buf + hdr.size)
+            goto fail;
+        (*args)[i] = s;
+    }
+    return conn;
+
+fail:
+    free(buf);
+    free(*args);
+    close(io[0]);
+    close(io[1]);
+    close(io[2]);
+    close(conn);
+    return -1;
+}
+
+/* send the exit status of its menu to a client and hang up */
+void server_reply(int conn, int status) {
+    unsigned char c = status;
+
+    writeall(conn, &c, 1);
+    close(conn);
+}
+
+/* Run the menu of argv in the daemon listening on path, handing it the
+ * working directory, stdin, stdout and stderr, and return its exit status; -1
+ * if no daemon of the user took it in time and the menu is still to be run. */
+int server_call(const char *path, int argc, char *argv[]) {
+    union fds ctl;
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cm;
+    struct header hdr;
+    struct pollfd pfd;
+    int fd, i, io[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char cwd[PATH_MAX];
+    unsigned char c;
+    size_t size;
+    uid_t uid;
+
+    if (!getcwd(cwd, sizeof cwd))
+        return -1;
+    size = strlen(cwd) + 1;
+    for (i = 1; i < argc; i++)
+        size += strlen(argv[i]) + 1;
+    if (size > MAXREQUEST || !privatedir(path, 0) || (fd = dial(path)) < 0)
+        return -1;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (peeruid(fd, &uid) < 0 || uid != getuid() || poll(&pfd, 1, READYWAIT) != 1 || readall(fd, &c, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    hdr.nargs = argc - 1;
+    hdr.size = size;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof hdr;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof io);
+    memcpy(CMSG_DATA(cm), io, sizeof io);
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof hdr) {
+        close(fd);
+        return -1;
+    }
+
+    /* the daemon may read stdin from now on, so the menu cannot be run here
+     * any more if something goes wrong */
+    c = 1;
+    if (writeall(fd, cwd, strlen(cwd) + 1) == 0) {
+        for (i = 1; i < argc && writeall(fd, argv[i], strlen(argv[i]) + 1) == 0; i++)
+            ;
+        if (i == argc && readall(fd, &c, 1) < 0)
+            c = 1;
+    }
+    close(fd);
+    return c;
+}
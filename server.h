@@ -0,0 +1,12 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Server abstraction */
+const char *server_path(void);
+int server_listen(const char *path);
+int server_accept(int fd, int io[3], char ***args);
+void server_reply(int conn, int status);
+int server_call(const char *path, int argc, char *argv[]);
+
+#endif  // SERVER_H
@@ -0,0 +1,123 @@
+/* See LICENSE file for copyright and license details. */
+#include "trigram.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUCKETBITS 18 /* trigrams are hashed into 1 << BUCKETBITS posting lists */
+#define NBUCKETS   (1 << BUCKETBITS)
+#define MAXTRIGRAMS 64 /* trigrams of a query that are intersected */
+
+/* ids of the texts containing a trigram, ascending, as varint encoded deltas */
+typedef struct {
+    unsigned char *buf;
+    unsigned int len, size;
+    unsigned int last;  /* last id added plus one, 0 if none */
+    unsigned int count; /* number of ids */
+} Posting;
+
+struct Trigram {
+    Posting *lists;
+};
+
+static unsigned int bucket(const char *s) {
+    unsigned int t = (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2];
+    return (t * 2654435761U) >> (32 - BUCKETBITS);
+}
+
+Trigram *trigram_create(void) {
+    Trigram *t = ecalloc(1, sizeof(Trigram));
+
+    t->lists = ecalloc(NBUCKETS, sizeof(Posting));
+    return t;
+}
+
+void trigram_free(Trigram *t) {
+    size_t i;
+
+    if (!t)
+        return;
+    for (i = 0; i < NBUCKETS; i++)
+        free(t->lists[i].buf);
+    free(t->lists);
+    free(t);
+}
+
+/* Index the len bytes of s under id; ids must be added in ascending order. */
+void trigram_add(Trigram *t, unsigned int id, const char *s, size_t len) {
+    Posting *p;
+    unsigned int d;
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i++) {
+        p = &t->lists[bucket(s + i)];
+        if (p->last == id + 1) /* trigram repeated in s or hash collision */
+            continue;
+        if (p->len + 5 > p->size) {
+            p->size = MAX(16, p->size * 2);
+            if (!(p->buf = realloc(p->buf, p->size)))
+                die("cannot realloc %u bytes:", p->size);
+        }
+        for (d = id + 1 - p->last; d >= 0x80; d >>= 7)
+            p->buf[p->len++] = (d & 0x7f) | 0x80;
+        p->buf[p->len++] = d;
+        p->last = id + 1;
+        p->count++;
+    }
+}
+
+/* decode the next id of a posting list at *off, given the previous one */
+static unsigned int next(const Posting *p, unsigned int *off, unsigned int prev) {
+    unsigned int d = 0, shift = 0;
+    unsigned char c;
+
+    do {
+        c = p->buf[(*off)++];
+        d |= (unsigned int)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return prev + d;
+}
+
+static int cmpcount(const void *a, const void *b) {
+    unsigned int ca = (*(Posting *const *)a)->count, cb = (*(Posting *const *)b)->count;
+
+    return (ca > cb) - (ca < cb);
+}
+
+/* Store in *ids (allocated, to be freed by the caller) the ids of all texts
+ * containing every trigram of the len bytes of s, in ascending order, and
+ * return their number. The result may contain texts not containing s, which
+ * have to be verified. s must be at least 3 bytes long. */
+size_t trigram_find(Trigram *t, const char *s, size_t len, unsigned int **ids) {
+    Posting *lists[MAXTRIGRAMS];
+    unsigned int off, id, *out;
+    size_t i, j, k, n = 0, nlists = 0;
+
+    for (i = 0; i + 3 <= len && nlists < MAXTRIGRAMS; i++) {
+        lists[nlists] = &t->lists[bucket(s + i)];
+        for (j = 0; j < nlists && lists[j] != lists[nlists]; j++)
+            ;
+        if (j == nlists)
+            nlists++;
+    }
+    /* start from the shortest list and intersect the longer ones with it */
+    qsort(lists, nlists, sizeof *lists, cmpcount);
+    out = ecalloc(MAX(lists[0]->count, 1), sizeof *out);
+    for (off = 0, id = 0; off < lists[0]->len; out[n++] = id - 1)
+        id = next(lists[0], &off, id);
+    for (i = 1; i < nlists && n; i++) {
+        for (j = 0, k = 0, off = 0, id = 0; j < n && off < lists[i]->len;) {
+            id = next(lists[i], &off, id);
+            while (j < n && out[j] < id - 1)
+                j++;
+            if (j < n && out[j] == id - 1)
+                out[k++] = out[j++];
+        }
+        n = k;
+    }
+    *ids = out;
+    return n;
+}
@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+#include <stddef.h>
+
+/* Trigram index abstraction */
+typedef struct Trigram Trigram;
+
+Trigram *trigram_create(void);
+void trigram_free(Trigram *t);
+void trigram_add(Trigram *t, unsigned int id, const char *s, size_t len);
+size_t trigram_find(Trigram *t, const char *s, size_t len, unsigned int **ids);
+
+#endif  // TRIGRAM_H